@@ -0,0 +1,43 @@
+# - Build a layout pack from layouts.csv
+# Run as a script:
+#  cmake -DSOURCE_DIR=<dir with layouts.csv> -DOUTPUT=<pack> -P LayoutPack.cmake
+#
+# The pack starts with a CSV directory, one row per layout giving where its
+# board and bindings sections are, followed by a "%%" line and the sections
+# themselves.  Offsets count bytes from the start of the first section.  See
+# src/keylayout.hh for the reader.
+
+FILE(STRINGS ${SOURCE_DIR}/layouts.csv ROWS)
+
+SET(HEADER_SEEN FALSE)
+SET(DIRECTORY "# generated from layouts.csv, do not edit\nlayout, board_offset, board_length, bindings_offset, bindings_length\n")
+SET(SECTIONS "")
+SET(OFFSET 0)
+
+FOREACH(ROW ${ROWS})
+  STRING(STRIP "${ROW}" ROW)
+  IF(ROW STREQUAL "" OR ROW MATCHES "^#")
+    # comment or empty line
+  ELSEIF(NOT HEADER_SEEN)
+    SET(HEADER_SEEN TRUE)
+  ELSE()
+    STRING(REPLACE "," ";" FIELDS "${ROW}")
+    LIST(GET FIELDS 0 NAME)
+    STRING(STRIP "${NAME}" NAME)
+    SET(ENTRY "${NAME}")
+
+    FOREACH(COLUMN 1 2)
+      LIST(GET FIELDS ${COLUMN} FILE)
+      STRING(STRIP "${FILE}" FILE)
+      FILE(READ ${SOURCE_DIR}/${FILE} CONTENT)
+      STRING(LENGTH "${CONTENT}" LENGTH)
+      SET(ENTRY "${ENTRY}, ${OFFSET}, ${LENGTH}")
+      SET(SECTIONS "${SECTIONS}${CONTENT}")
+      MATH(EXPR OFFSET "${OFFSET} + ${LENGTH}")
+    ENDFOREACH()
+
+    SET(DIRECTORY "${DIRECTORY}${ENTRY}\n")
+  ENDIF()
+ENDFOREACH()
+
+FILE(WRITE ${OUTPUT} "${DIRECTORY}%%\n${SECTIONS}")
@@ -0,0 +1,162 @@
+#include "arpeggiator.hh"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "midi.hh"
+
+bool arp_config_from_string(const char *s, ArpConfig *config) {
+  static const struct {
+    const char *name;
+    ArpOrder order;
+  } orders[] = {
+      {"up", ARP_UP},
+      {"down", ARP_DOWN},
+      {"random", ARP_RANDOM},
+      {"as-played", ARP_AS_PLAYED},
+  };
+  ArpConfig parsed;
+  const char *comma = strchr(s, ',');
+  size_t length = comma != NULL ? (size_t)(comma - s) : strlen(s);
+  char *end;
+
+  parsed.order = ARP_OFF;
+  for (const auto &o : orders)
+    if (strlen(o.name) == length && strncmp(s, o.name, length) == 0)
+      parsed.order = o.order;
+
+  if (parsed.order == ARP_OFF) return (false);
+
+  /* The numbers that are there, in order. */
+  for (int field = 0; comma != NULL; field++) {
+    double value = strtod(comma + 1, &end);
+
+    if (end == comma + 1 || (*end != ',' && *end != '\0')) return (false);
+
+    switch (field) {
+      case 0:
+        parsed.octaves = value;
+        break;
+      case 1:
+        parsed.rate = value;
+        break;
+      case 2:
+        parsed.gate = value;
+        break;
+      case 3:
+        parsed.tempo = value;
+        break;
+      default:
+        return (false);
+    }
+
+    comma = *end == ',' ? end : NULL;
+  }
+
+  if (parsed.octaves < 1 || parsed.octaves > Arpeggiator::MAX_OCTAVES ||
+      parsed.rate < 1 || parsed.gate <= 0.0 || parsed.gate > 1.0 ||
+      parsed.tempo <= 0.0)
+    return (false);
+
+  *config = parsed;
+  return (true);
+}
+
+void Arpeggiator::played(const unsigned char *data) {
+  if ((data[0] & 0xF0) == MIDI_NOTE_ON && data[2] != 0) velocity = data[2];
+}
+
+/* The notes of one pass, octave after octave. */
+int Arpeggiator::pattern(const NoteSet &held, int *notes) const {
+  int keys[NNOTES];
+  int nkeys = 0, count = 0;
+
+  held.for_each([&](int note) { keys[nkeys++] = note; });
+
+  if (config.order == ARP_AS_PLAYED)
+    std::sort(keys, keys + nkeys,
+              [this](int a, int b) { return (pressed[a] < pressed[b]); });
+
+  for (int octave = 0; octave < config.octaves; octave++) {
+    for (int i = 0; i < nkeys; i++) {
+      int note = keys[i] + 12 * octave;
+
+      if (note < NNOTES) notes[count++] = note;
+    }
+  }
+
+  if (config.order == ARP_DOWN) std::reverse(notes, notes + count);
+
+  return (count);
+}
+
+int Arpeggiator::run(const NoteSet &held, int channel, double beat,
+                     double frames_per_beat, double step,
+                     jack_nframes_t nframes, ArpEvent *out, int max) {
+  int notes[NNOTES * MAX_OCTAVES];
+  int count, n = 0;
+  double end = beat + nframes / frames_per_beat;
+  int64_t k = ceil(beat / step);
+
+  auto emit = [&](double when, int status, int ch, int note, int vel) {
+    double frame = (when - beat) * frames_per_beat;
+
+    out[n].time = std::clamp(lround(frame), 0L, (long)nframes - 1);
+    out[n].data[0] = status | ch;
+    out[n].data[1] = note;
+    out[n].data[2] = vel;
+    n++;
+  };
+
+  held.without(last_held).for_each([&](int note) {
+    pressed[note] = next_press++;
+  });
+  last_held = held;
+
+  count = pattern(held, notes);
+  if (count == 0) position = 0;
+
+  /* Played at the very end of the last cycle already. */
+  if (k == last_step) k++;
+
+  /* The beat jumped back, the transport was moved or stopped. */
+  if (sounding >= 0 && off_beat > beat + step) off_beat = beat;
+
+  while (n < max) {
+    double on = k * step;
+    bool step_due = count > 0 && on < end;
+
+    /* Gates are at most a step long, so a note ends before the next. */
+    if (sounding >= 0 && off_beat < end && (!step_due || off_beat <= on)) {
+      emit(std::max(off_beat, beat), MIDI_NOTE_OFF, sounding_channel,
+           sounding, 0);
+      sounding = -1;
+      continue;
+    }
+
+    /* A step that plays and ends within the cycle takes two messages. */
+    if (!step_due || n + 2 > max) break;
+
+    if (config.order == ARP_RANDOM) {
+      /* xorshift, cheap and good enough to pick notes. */
+      random_state ^= random_state << 13;
+      random_state ^= random_state >> 17;
+      random_state ^= random_state << 5;
+      sounding = notes[random_state % count];
+    } else {
+      sounding = notes[position % count];
+      position = (position + 1) % count;
+    }
+
+    sounding_channel = channel;
+    off_beat = on + config.gate * step;
+    emit(on, MIDI_NOTE_ON, channel, sounding, velocity);
+
+    last_step = k++;
+  }
+
+  return (n);
+}
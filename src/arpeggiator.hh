@@ -0,0 +1,85 @@
+#pragma once
+
+#include <jack/jack.h>
+#include <stdint.h>
+
+#include "notestate.hh"
+
+enum ArpOrder {
+  ARP_OFF,
+  ARP_UP,
+  ARP_DOWN,
+  ARP_RANDOM,
+  // in the order the keys went down
+  ARP_AS_PLAYED,
+};
+
+struct ArpConfig {
+  ArpOrder order = ARP_OFF;
+  // octaves the held notes are repeated over, 1 - Arpeggiator::MAX_OCTAVES
+  int octaves = 1;
+  // note value of a step, 16 for sixteenths
+  int rate = 16;
+  // part of a step the notes sound for, 0 - 1
+  double gate = 0.5;
+  // quarter notes per minute, when the JACK transport gives no tempo
+  double tempo = 120.0;
+};
+
+/**
+ * "up", "down", "random" or "as-played", optionally followed by the
+ * octaves, rate, gate and tempo, comma separated: "up,2,16,0.5,120".  False
+ * if it is none of them or a number is out of range.
+ */
+bool arp_config_from_string(const char *s, ArpConfig *config);
+
+// a message the arpeggiator plays, at a frame of the cycle
+struct ArpEvent {
+  jack_nframes_t time;
+  unsigned char data[3];
+};
+
+/**
+ * Plays the keys held down one after the other, a step at a time, on the
+ * beat.  Runs in the JACK thread: all of its state is fixed size and run()
+ * neither allocates nor blocks.
+ */
+class Arpeggiator {
+ public:
+  static constexpr int MAX_OCTAVES = 4;
+
+  void configure(const ArpConfig &new_config) { config = new_config; }
+
+  // a note message the arpeggiator plays instead of sending it
+  void played(const unsigned char *data);
+
+  /**
+   * Fills out with at most max messages to send during a cycle of nframes
+   * starting at beat, steps being step beats apart, and returns how many.
+   * held are the keys down on channel.  Messages are in time order.
+   */
+  int run(const NoteSet &held, int channel, double beat,
+          double frames_per_beat, double step, jack_nframes_t nframes,
+          ArpEvent *out, int max);
+
+  // forgets the note sounding, after an all notes off silenced it
+  void reset() { sounding = -1; }
+
+ private:
+  int pattern(const NoteSet &held, int *notes) const;
+
+  ArpConfig config;
+  // when each held key went down, for ARP_AS_PLAYED
+  NoteSet last_held = {};
+  uint32_t pressed[NNOTES] = {};
+  uint32_t next_press = 0;
+  int velocity = 100;
+  // next note of the pattern
+  int position = 0;
+  int64_t last_step = INT64_MIN;
+  uint32_t random_state = 1;
+  // the note playing, -1 for none, and when it ends
+  int sounding = -1;
+  int sounding_channel = 0;
+  double off_beat = 0.0;
+};
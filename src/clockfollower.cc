@@ -0,0 +1,115 @@
+#include "clockfollower.hh"
+
+#include <algorithm>
+
+#include "midi.hh"
+
+// the weight of a new measurement in the tempo estimate
+#define TEMPO_SMOOTHING 0.1
+
+// a gap this many ticks long means the clock stopped for a while
+#define CLOCK_GAP_TICKS 4.0
+
+double ClockPosition::beat_at(jack_nframes_t frame) const {
+  double ticks = tick;
+
+  if (tick < 0) return -1.0;
+
+  if (frames_per_tick > 0.0) {
+    /* Differences of frame times wrap like the times do. */
+    int32_t since = frame - tick_frame;
+
+    ticks += std::clamp(since / frames_per_tick, 0.0, 1.0);
+  }
+
+  return ticks / TICKS_PER_BEAT;
+}
+
+void ClockFollower::receive(const unsigned char *data, int len,
+                            jack_nframes_t time) {
+  switch (data[0]) {
+    case MIDI_CLOCK: {
+      double period = time - last_frame;
+
+      if (!have_last || (local.frames_per_tick > 0.0 &&
+                         period > local.frames_per_tick * CLOCK_GAP_TICKS)) {
+        /* Nothing to measure against, or the clock paused; start over. */
+        local.frames_per_tick = 0.0;
+      } else if (local.frames_per_tick == 0.0) {
+        local.frames_per_tick = period;
+      } else {
+        local.frames_per_tick +=
+            (period - local.frames_per_tick) * TEMPO_SMOOTHING;
+      }
+
+      last_frame = time;
+      have_last = true;
+
+      /* Clock runs while stopped too, to keep the tempo known. */
+      if (local.running) {
+        local.tick = next_tick++;
+        local.tick_frame = time;
+      }
+      break;
+    }
+
+    case MIDI_START:
+      next_tick = 0;
+      local.tick = -1;
+      local.running = true;
+      break;
+
+    case MIDI_CONTINUE:
+      local.running = true;
+      break;
+
+    case MIDI_STOP:
+      local.running = false;
+      break;
+
+    case MIDI_SONG_POSITION:
+      if (len < 3) return;
+
+      /* In sixteenths, six ticks each. */
+      next_tick = (data[1] | data[2] << 7) * 6;
+      local.tick = -1;
+      break;
+
+    default:
+      return;
+  }
+
+  publish();
+}
+
+void ClockFollower::publish() {
+  uint32_t s = seq.load(std::memory_order_relaxed);
+
+  seq.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  running.store(local.running, std::memory_order_relaxed);
+  tick.store(local.tick, std::memory_order_relaxed);
+  tick_frame.store(local.tick_frame, std::memory_order_relaxed);
+  frames_per_tick.store(local.frames_per_tick, std::memory_order_relaxed);
+
+  seq.store(s + 2, std::memory_order_release);
+}
+
+bool ClockFollower::read(ClockPosition &out) const {
+  ClockPosition snapshot;
+  uint32_t before = seq.load(std::memory_order_acquire);
+
+  if (before & 1) return false;
+
+  snapshot.running = running.load(std::memory_order_relaxed);
+  snapshot.tick = tick.load(std::memory_order_relaxed);
+  snapshot.tick_frame = tick_frame.load(std::memory_order_relaxed);
+  snapshot.frames_per_tick = frames_per_tick.load(std::memory_order_relaxed);
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (seq.load(std::memory_order_relaxed) != before) return false;
+
+  out = snapshot;
+  return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <jack/jack.h>
+#include <stdint.h>
+
+#include <atomic>
+
+/* Where an external MIDI clock was at its latest tick. */
+struct ClockPosition {
+  static constexpr int TICKS_PER_BEAT = 24;
+
+  // between a start or continue and a stop
+  bool running = false;
+  // ticks since the start of the song, of the latest tick; -1 if none came
+  // since the position was set
+  int64_t tick = -1;
+  // when the latest tick arrived
+  jack_nframes_t tick_frame = 0;
+  // filtered time between ticks, 0 until two ticks came in a row
+  double frames_per_tick = 0.0;
+
+  // quarter notes per minute, 0 if unknown
+  double tempo(jack_nframes_t sample_rate) const {
+    if (frames_per_tick <= 0.0) return 0.0;
+
+    return sample_rate * 60.0 / (frames_per_tick * TICKS_PER_BEAT);
+  }
+
+  /**
+   * Beats since the start of the song at frame, going on from the latest
+   * tick at the current tempo, but never further than the next tick is due.
+   * Negative if the position is unknown.
+   */
+  double beat_at(jack_nframes_t frame) const;
+};
+
+/**
+ * Follows the MIDI clock arriving on the input port: clock ticks, start,
+ * continue, stop and song position pointers.  The tempo is estimated from
+ * the time between ticks in frames, smoothed so the jitter of hardware
+ * clocks doesn't show.
+ *
+ * The JACK thread feeds it with receive() and reads position() directly, so
+ * everything else done in the process callback sees the clock as of the
+ * current cycle.  Other threads get a copy with read(), a seqlock like
+ * NoteMirror's.
+ */
+class ClockFollower {
+ public:
+  // JACK thread: a message that arrived at frame time
+  void receive(const unsigned char *data, int len, jack_nframes_t time);
+
+  // JACK thread
+  const ClockPosition &position() const { return local; }
+
+  /**
+   * Copies the latest position into out, from any thread.  Returns false,
+   * leaving out untouched, if an update was in progress.
+   */
+  bool read(ClockPosition &out) const;
+
+ private:
+  void publish();
+
+  ClockPosition local;
+  // of the next tick to come
+  int64_t next_tick = 0;
+  // of the latest tick, running or not, for measuring
+  jack_nframes_t last_frame = 0;
+  bool have_last = false;
+
+  std::atomic<uint32_t> seq{0};
+  std::atomic<bool> running{false};
+  std::atomic<int64_t> tick{-1};
+  std::atomic<jack_nframes_t> tick_frame{0};
+  std::atomic<double> frames_per_tick{0.0};
+};
@@ -0,0 +1,16 @@
+#include "controllerslots.hh"
+
+void ControllerSlots::set(int channel, int slot, int value) {
+  values[channel][slot].store(value, std::memory_order_relaxed);
+
+  /* Publishes the value along with the mark. */
+  dirty[channel][slot / 64].fetch_or(1ULL << (slot % 64),
+                                     std::memory_order_release);
+  dirty_channels.fetch_or(1 << channel, std::memory_order_release);
+}
+
+void ControllerSlots::mark(int channel, int slot) {
+  dirty[channel][slot / 64].fetch_or(1ULL << (slot % 64),
+                                     std::memory_order_relaxed);
+  dirty_channels.fetch_or(1 << channel, std::memory_order_relaxed);
+}
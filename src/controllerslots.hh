@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+
+/**
+ * The latest value of continuous controls, a slot per controller, one for
+ * the pitch bend and one for each 14 bit controller on every channel, for the
+ * JACK thread to send once per cycle.
+ *
+ * Dragging a slider changes its value far more often than a period goes by;
+ * only the last value set before a cycle is worth sending, so instead of
+ * queueing every change, set() overwrites the slot and marks it dirty, and
+ * drain() sends what is dirty.  Neither ever blocks.  A value set while a
+ * drain is running may be sent twice, never lost.
+ */
+class ControllerSlots {
+ public:
+  static constexpr int CHANNELS = 16;
+  static constexpr int PITCH_BEND = 128;
+  // controllers 0 - 31 sent as a pair, with their fine part as 32 - 63
+  static constexpr int FINE_CONTROLLERS = 129;
+  static constexpr int SLOTS = FINE_CONTROLLERS + 32;
+
+  // value is 0 - 127 for controllers, 0 - 16383 for the 14 bit ones
+  void set(int channel, int slot, int value);
+
+  // marks a slot dirty again, keeping its value; JACK thread only
+  void mark(int channel, int slot);
+
+  /**
+   * Calls f(channel, slot, value) for every slot set since it was last
+   * drained.  If f returns false, that slot and the ones not reached yet stay
+   * dirty for the next drain.  JACK thread only.
+   */
+  template <typename F>
+  void drain(F &&f);
+
+ private:
+  static constexpr int WORDS = (SLOTS + 63) / 64;
+
+  std::atomic<uint16_t> values[CHANNELS][SLOTS];
+  std::atomic<uint64_t> dirty[CHANNELS][WORDS];
+  // channels with anything dirty, so idle cycles check a single word
+  std::atomic<uint16_t> dirty_channels;
+};
+
+template <typename F>
+void ControllerSlots::drain(F &&f) {
+  uint16_t channels = dirty_channels.exchange(0, std::memory_order_acquire);
+
+  while (channels != 0) {
+    int channel = __builtin_ctz(channels);
+
+    for (int w = 0; w < WORDS; w++) {
+      uint64_t bits =
+          dirty[channel][w].exchange(0, std::memory_order_acquire);
+
+      for (; bits != 0; bits &= bits - 1) {
+        int slot = w * 64 + __builtin_ctzll(bits);
+
+        if (!f(channel, slot,
+               values[channel][slot].load(std::memory_order_relaxed))) {
+          /* Put back what is left; words after this one were not taken. */
+          dirty[channel][w].fetch_or(bits, std::memory_order_relaxed);
+          dirty_channels.fetch_or(channels, std::memory_order_relaxed);
+          return;
+        }
+      }
+    }
+
+    channels &= channels - 1;
+  }
+}
@@ -1,5 +1,10 @@
 #include "easycsv.hh"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <iostream>
 #include <span>
 #include <string_view>
@@ -103,3 +108,43 @@ void CSVParser::readFile(FILE *file, std::vector<std::string> expected_columns,
 
   csv_fini(&parser, &CSVInfo::cb1_item, &CSVInfo::cb2_assemble_row, &info);
 }
+
+std::optional<MappedFile> MappedFile::open(const std::filesystem::path &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return std::nullopt;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return std::nullopt;
+  }
+
+  // mmap() refuses empty mappings, an empty file is just no data
+  if (st.st_size == 0) {
+    close(fd);
+    return {MappedFile{NULL, 0}};
+  }
+
+  void *addr =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  int saved = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    errno = saved;
+    return std::nullopt;
+  }
+
+  return {MappedFile{reinterpret_cast<char *>(addr), (size_t)st.st_size}};
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+    : addr(other.addr), length(other.length) {
+  other.addr = NULL;
+  other.length = 0;
+}
+
+MappedFile::~MappedFile() {
+  if (addr != NULL) munmap(addr, length);
+}
@@ -6,13 +6,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <array>
+#include <filesystem>
 #include <functional>
 #include <optional>
 #include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#include "util.hh"
+
 typedef const std::function<void(const std::vector<std::string>& row_items)>
     row_parser_callback;
 
@@ -34,3 +40,271 @@ class CSVParser {
   void readFile(FILE* file, std::vector<std::string> expectedColumns,
                 row_parser_callback callback);
 };
+
+/**
+ * A file mapped copy-on-write into memory, so it can be parsed in place.
+ * Writes (see parse_csv_rows) only ever touch our private copy of a page.
+ */
+class MappedFile {
+ private:
+  char* addr;
+  size_t length;
+
+  inline MappedFile(char* addr, size_t length) : addr(addr), length(length) {}
+
+ public:
+  // on failure returns std::nullopt with errno set
+  static std::optional<MappedFile> open(const std::filesystem::path& path);
+
+  MappedFile(MappedFile&& other);
+
+  MappedFile& operator=(MappedFile&& other) = delete;
+
+  ~MappedFile();
+
+  std::span<char> data() const { return {addr, length}; }
+};
+
+// fields after this many are dropped
+constexpr size_t CSV_MAX_COLUMNS = 16;
+
+constexpr bool csv_is_space(char c) { return c == ' ' || c == '\t'; }
+
+constexpr bool csv_is_term(char c) { return c == '\r' || c == '\n'; }
+
+/**
+ * Parses CSV text without copying it, calling
+ * callback(std::span<std::string_view> row) for every row.  The views point
+ * into text and stay valid as long as it does.
+ *
+ * Follows what CSVParser does: fields are trimmed of spaces and tabs, may be
+ * quoted, empty lines and rows whose first field starts with '#' are skipped,
+ * and so is the first remaining row (the header) unless skip_header is false.
+ *
+ * Doubled quotes inside a quoted field are unescaped in place when text is
+ * writable; in read-only text (e.g. constexpr data) they are left as they are.
+ *
+ * Returns the number of rows passed to callback.
+ */
+template <typename CharT, typename RowCallback>
+constexpr size_t parse_csv_rows(std::span<CharT> text, RowCallback&& callback,
+                                bool skip_header = true) {
+  std::array<std::string_view, CSV_MAX_COLUMNS> fields{};
+  const size_t n = text.size();
+  CharT* base = text.data();
+  size_t i = 0, rows = 0;
+
+  while (i < n) {
+    size_t nfields = 0;
+    bool empty = true;
+
+    for (;;) {
+      size_t begin, end;
+
+      while (i < n && csv_is_space(base[i])) i++;
+
+      if (i < n && base[i] == '"') {
+        size_t out = ++i;
+
+        begin = i;
+        while (i < n) {
+          if (base[i] == '"') {
+            if (i + 1 < n && base[i + 1] == '"') {
+              if constexpr (std::is_const_v<CharT>) {
+                out += 2;
+              } else {
+                base[out++] = '"';
+              }
+              i += 2;
+              continue;
+            }
+            i++;
+            break;
+          }
+          if constexpr (!std::is_const_v<CharT>) base[out] = base[i];
+          out++;
+          i++;
+        }
+        end = out;
+        empty = false;
+
+        // anything between the closing quote and the separator is ignored
+        while (i < n && base[i] != ',' && !csv_is_term(base[i])) i++;
+      } else {
+        begin = i;
+        while (i < n && base[i] != ',' && !csv_is_term(base[i])) i++;
+        end = i;
+        while (end > begin && csv_is_space(base[end - 1])) end--;
+        if (end > begin) empty = false;
+      }
+
+      if (nfields < fields.size())
+        fields[nfields++] = std::string_view(base + begin, end - begin);
+
+      if (i < n && base[i] == ',') {
+        i++;
+        empty = false;
+        continue;
+      }
+
+      while (i < n && csv_is_term(base[i])) i++;
+      break;
+    }
+
+    if (empty) continue;
+
+    // ignore rows starting with #, as they are comments
+    if (!fields[0].empty() && fields[0][0] == '#') continue;
+
+    if (skip_header) {
+      skip_header = false;
+      continue;
+    }
+
+    callback(std::span<std::string_view>(fields.data(), nfields));
+    rows++;
+  }
+
+  return rows;
+}
+
+/**
+ * A column of a CSV schema: the header name it is bound by and the function
+ * that decodes its field into a Row.  Columns are usually made with
+ * csv_field, e.g.
+ *
+ *   {"code", csv_field<&BoardKey::code, decode_int>}
+ */
+template <typename Row>
+struct CSVColumn {
+  std::string_view name;
+  bool (*decode)(std::string_view field, Row& row);
+};
+
+// decodes field straight into the member of row
+template <auto Member, auto Decode, typename Row>
+constexpr bool csv_field(std::string_view field, Row& row) {
+  return Decode(field, row.*Member);
+}
+
+// decoders, false if the field is not valid
+
+constexpr bool decode_int(std::string_view field, int& out) {
+  auto value{parse_int(field)};
+  if (!value) return false;
+  out = value.value();
+  return true;
+}
+
+constexpr bool decode_note(std::string_view field, int& out) {
+  auto value{parse_note(field)};
+  if (!value) return false;
+  out = value.value();
+  return true;
+}
+
+// the view points into the text being decoded
+constexpr bool decode_string(std::string_view field, std::string_view& out) {
+  out = field;
+  return !field.empty();
+}
+
+template <typename E>
+struct CSVEnumValue {
+  std::string_view name;
+  E value;
+};
+
+// decodes one of the names in Values, e.g. decode_enum<kinds, Kind>
+template <const auto& Values, typename E>
+constexpr bool decode_enum(std::string_view field, E& out) {
+  for (const CSVEnumValue<E>& v : Values) {
+    if (v.name == field) {
+      out = v.value;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct CSVDecodeResult {
+  // rows decoded into out
+  size_t rows = 0;
+  // rows skipped because a field was missing or did not decode
+  size_t invalid = 0;
+  // 1 based number of the first invalid row, not counting comments
+  size_t first_invalid = 0;
+  // valid rows that did not fit into out
+  size_t dropped = 0;
+  // a schema column the header does not have, nothing is decoded then
+  std::string_view missing;
+
+  constexpr explicit operator bool() const { return missing.empty(); }
+};
+
+/**
+ * Decodes CSV text into out in one pass, using parse_csv_rows.
+ *
+ * The first row is the header and binds every column of the schema to a
+ * field by name, so files may order their columns freely and carry extra ones.
+ * Each following row is decoded straight from the text into a value
+ * initialized Row; rows where any column fails to decode are skipped and
+ * counted in the result.  Row is given explicitly:
+ *
+ *   decode_csv<BoardKey>(file->data(), board_columns, keys)
+ */
+template <typename Row, typename CharT>
+constexpr CSVDecodeResult decode_csv(std::span<CharT> text,
+                                     std::span<const CSVColumn<Row>> columns,
+                                     std::span<Row> out) {
+  CSVDecodeResult result;
+  std::array<size_t, CSV_MAX_COLUMNS> index{};
+  bool have_header = false;
+  size_t row_number = 0;
+
+  if (columns.size() > index.size()) {
+    result.missing = columns[index.size()].name;
+    return result;
+  }
+
+  parse_csv_rows(
+      text,
+      [&](std::span<std::string_view> row) {
+        if (!result) return;
+
+        if (!have_header) {
+          have_header = true;
+          for (size_t c = 0; c < columns.size(); c++) {
+            size_t i = 0;
+            while (i < row.size() && row[i] != columns[c].name) i++;
+            if (i == row.size()) {
+              result.missing = columns[c].name;
+              return;
+            }
+            index[c] = i;
+          }
+          return;
+        }
+
+        row_number++;
+        Row decoded{};
+        for (size_t c = 0; c < columns.size(); c++) {
+          if (index[c] >= row.size() ||
+              !columns[c].decode(row[index[c]], decoded)) {
+            if (result.invalid++ == 0) result.first_invalid = row_number;
+            return;
+          }
+        }
+
+        if (result.rows < out.size())
+          out[result.rows++] = decoded;
+        else
+          result.dropped++;
+      },
+      false);
+
+  // an empty file has no header either
+  if (!have_header && !columns.empty()) result.missing = columns[0].name;
+
+  return result;
+}
@@ -18,9 +18,12 @@ struct KeyBind {
   keybind_callback callback;
   keybind_destructor destroy_data;
   void *data;
+  // acts once per press, not again on autorepeat
+  bool once;
   KeyBind(keybind_callback callback, keybind_destructor destroy_data,
-          void *data = NULL)
-      : callback(callback), destroy_data(destroy_data), data(data){};
+          void *data = NULL, bool once = false)
+      : callback(callback), destroy_data(destroy_data), data(data),
+        once(once){};
 };
 
 // TODO, reuse KeyBind objects?, delete all
@@ -53,6 +56,13 @@ class KeyMap {
     keymap[key] = new KeyBind(bind);
   }
 
+  const KeyBind *find(const std::string &key) const {
+    if (auto pair = keymap.find(key); pair != keymap.end()) {
+      return pair->second;
+    }
+    return NULL;
+  }
+
   bool callback(const std::string &key, void *event) {
     if (auto pair = keymap.find(key); pair != keymap.end()) {
       auto bind = pair->second;
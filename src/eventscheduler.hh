@@ -0,0 +1,110 @@
+#pragma once
+
+#include <jack/jack.h>
+#include <stdint.h>
+
+#include <array>
+#include <utility>
+
+/**
+ * Events held back until a frame time, for the JACK thread.  A binary heap
+ * in a fixed array, so holding and releasing events never allocates nor
+ * takes longer than log N steps.  Events for the same frame come out in the
+ * order they went in, and frame times may wrap around.
+ */
+template <typename T, size_t N>
+class EventScheduler {
+ public:
+  bool empty() const { return size == 0; }
+
+  bool full() const { return size == N; }
+
+  // false, holding nothing, if full
+  bool hold(jack_nframes_t time, const T &event);
+
+  // of the earliest event; not when empty()
+  jack_nframes_t next_time() const { return heap[0].time; }
+
+  // the earliest event; not when empty()
+  const T &peek() const { return heap[0].event; }
+
+  // takes out the earliest event; not when empty()
+  T pop();
+
+  // drops the events pred(event) is true for
+  template <typename Pred>
+  void erase_if(Pred &&pred);
+
+  void clear() { size = 0; }
+
+ private:
+  struct Entry {
+    jack_nframes_t time;
+    uint32_t order;
+    T event;
+  };
+
+  static bool before(const Entry &a, const Entry &b) {
+    int32_t d = a.time - b.time;
+
+    return d != 0 ? d < 0 : (int32_t)(a.order - b.order) < 0;
+  }
+
+  void sift_down(size_t i);
+
+  std::array<Entry, N> heap;
+  size_t size = 0;
+  uint32_t next_order = 0;
+};
+
+template <typename T, size_t N>
+bool EventScheduler<T, N>::hold(jack_nframes_t time, const T &event) {
+  size_t i = size;
+
+  if (full()) return false;
+
+  heap[size++] = {time, next_order++, event};
+
+  while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+    std::swap(heap[i], heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+
+  return true;
+}
+
+template <typename T, size_t N>
+T EventScheduler<T, N>::pop() {
+  T event = heap[0].event;
+
+  heap[0] = heap[--size];
+  sift_down(0);
+
+  return event;
+}
+
+template <typename T, size_t N>
+template <typename Pred>
+void EventScheduler<T, N>::erase_if(Pred &&pred) {
+  size_t kept = 0;
+
+  for (size_t i = 0; i < size; i++)
+    if (!pred(heap[i].event)) heap[kept++] = heap[i];
+
+  size = kept;
+  for (size_t i = size / 2; i-- > 0;) sift_down(i);
+}
+
+template <typename T, size_t N>
+void EventScheduler<T, N>::sift_down(size_t i) {
+  for (;;) {
+    size_t first = i, left = 2 * i + 1, right = left + 1;
+
+    if (left < size && before(heap[left], heap[first])) first = left;
+    if (right < size && before(heap[right], heap[first])) first = right;
+    if (first == i) break;
+
+    std::swap(heap[i], heap[first]);
+    i = first;
+  }
+}
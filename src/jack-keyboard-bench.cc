@@ -0,0 +1,276 @@
+/*
+ * Microbenchmarks for jack-keyboard's hot paths.
+ *
+ * Every benchmark prints one CSV row, benchmark,iterations,ns_per_op, so
+ * results can be diffed and tracked across releases.  Arguments select the
+ * benchmarks whose names contain any of them; with none, all of them run.
+ * Benchmarks that can't run here say so on stderr and print no row.
+ *
+ * The engine runs against the offline JACK stand-in, so results don't depend
+ * on a server or on audio hardware.
+ */
+
+#include <cairo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "easycsv.hh"
+#include "easykeyboard.hh"
+#include "keyboardrenderer.hh"
+#include "keylayout.hh"
+#include "midiengine.hh"
+#include "offlinejack.hh"
+#include "util.hh"
+
+// each benchmark runs for at least this long
+#define MIN_BENCH_SECONDS 0.5
+
+// rows in the generated CSV file
+#define CSV_BENCH_ROWS 100000
+
+#define KEYBOARD_WIDTH 1024
+#define KEYBOARD_HEIGHT 100
+
+static std::vector<std::string> filters;
+
+// keeps the compiler from optimizing a result away
+template <typename T>
+static inline void keep(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static bool selected(const char* name) {
+  if (filters.empty()) return true;
+
+  for (const std::string& filter : filters)
+    if (strstr(name, filter.c_str()) != NULL) return true;
+
+  return false;
+}
+
+// whether any of a group's benchmarks is, to skip the group's setup if none
+static bool any_selected(std::initializer_list<const char*> names) {
+  for (const char* name : names)
+    if (selected(name)) return true;
+
+  return false;
+}
+
+/**
+ * Runs body(n), which does n operations, with growing n until it takes
+ * MIN_BENCH_SECONDS, and prints the time per operation of the last run.
+ */
+template <typename Body>
+static void bench(const char* name, Body&& body) {
+  typedef std::chrono::steady_clock clock;
+
+  if (!selected(name)) return;
+
+  // warm up caches and lazily built state
+  body(1);
+
+  for (size_t n = 1;; n *= 2) {
+    clock::time_point start = clock::now();
+    body(n);
+    std::chrono::duration<double> elapsed = clock::now() - start;
+
+    if (elapsed.count() >= MIN_BENCH_SECONDS) {
+      printf("%s,%zu,%.3f\n", name, n, elapsed.count() * 1e9 / n);
+      fflush(stdout);
+      return;
+    }
+  }
+}
+
+static void skip(const char* name, const char* why) {
+  if (selected(name)) fprintf(stderr, "%s: skipped, %s\n", name, why);
+}
+
+static void bench_util() {
+  static const char* notes[] = {"C-1", "C#4", "Ab4", "G9", "Bb-1",
+                                "E5",  "F#3", "H2",  "C",  "D#10"};
+  static const char* ints[] = {"0",  "12",    "-7",  "127", "65535",
+                               "x1", "-2048", "300", "9",   "1000000"};
+  const size_t n_notes = sizeof(notes) / sizeof(notes[0]);
+  const size_t n_ints = sizeof(ints) / sizeof(ints[0]);
+
+  bench("string_to_midi", [&](size_t n) {
+    for (size_t i = 0; i < n; i++) keep(string_to_midi(notes[i % n_notes]));
+  });
+
+  bench("parse_int", [&](size_t n) {
+    for (size_t i = 0; i < n; i++) keep(parse_int(ints[i % n_ints]));
+  });
+}
+
+// a board file with CSV_BENCH_ROWS rows, removed when done
+static std::filesystem::path write_csv_file() {
+  char path[] = "/tmp/jack-keyboard-bench-XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+
+  FILE* file = fdopen(fd, "w");
+  fprintf(file, "code,name\n");
+  for (int i = 0; i < CSV_BENCH_ROWS; i++)
+    fprintf(file, "%d,\"key %d\"\n", i % NKEYCODES, i);
+  fclose(file);
+
+  return path;
+}
+
+static void bench_csv() {
+  if (!any_selected({"csv_parser_read_file", "csv_decode_mapped"})) return;
+
+  std::filesystem::path path = write_csv_file();
+
+  bench("csv_parser_read_file", [&](size_t n) {
+    std::optional<CSVParser> parser = CSVParser::create(CSV_APPEND_NULL);
+
+    for (size_t i = 0; i < n; i++) {
+      FILE* file = fopen(path.c_str(), "r");
+      size_t rows = 0;
+
+      parser->readFile(file, {"code", "name"},
+                       [&](const std::vector<std::string>& row) { rows++; });
+      fclose(file);
+      keep(rows);
+    }
+  });
+
+  bench("csv_decode_mapped", [&](size_t n) {
+    static BoardKey keys[CSV_BENCH_ROWS];
+
+    for (size_t i = 0; i < n; i++) {
+      std::optional<MappedFile> file = MappedFile::open(path);
+      CSVDecodeResult result =
+          decode_csv<BoardKey>(file->data(), board_columns, keys);
+      keep(result.rows);
+    }
+  });
+
+  unlink(path.c_str());
+}
+
+static void bench_keys() {
+  keymap::KeyMap map;
+  int calls = 0;
+  const std::string hit = "F5", miss = "F13";
+  static const char* names[] = {"F1", "F2", "F3",     "F4",   "F5",
+                                "F6", "F7", "Escape", "Home", "End"};
+
+  for (const char* name : names)
+    map.set(name, keymap::KeyBind([&calls](void*, void*) { calls++; },
+                                  [](void*) {}));
+
+  bench("keymap_callback_hit", [&](size_t n) {
+    for (size_t i = 0; i < n; i++) keep(map.callback(hit, NULL));
+  });
+
+  bench("keymap_callback_miss", [&](size_t n) {
+    for (size_t i = 0; i < n; i++) keep(map.callback(miss, NULL));
+  });
+
+  // what key_binding() does for every key event
+  bench("key_binding", [&](size_t n) {
+    const KeyBindingTable* table = &default_key_bindings;
+    int sum = 0;
+
+    for (size_t i = 0; i < n; i++) sum += table->lookup(i % (NKEYCODES + 16));
+    keep(sum);
+  });
+}
+
+static void bench_engine() {
+  // as many messages as are queued between two process cycles
+  const size_t burst = 64;
+
+  if (!any_selected({"engine_queue_process"})) return;
+
+  MidiEngine engine;
+  MidiEngineConfig config;
+  const char* error;
+
+  offline_jack::configure({});
+  config.client_name = "jack-keyboard-bench";
+  if ((error = engine.open(config)) != NULL ||
+      (error = engine.activate()) != NULL) {
+    skip("engine_queue_process", error);
+    return;
+  }
+
+  // every burst goes out in the next cycle, one period later
+  bench("engine_queue_process", [&](size_t n) {
+    for (size_t i = 0; i < n; i += burst) {
+      for (size_t j = 0; j < burst && i + j < n; j++)
+        engine.queue_new((j & 1) ? 0x80 : 0x90, 60, 100);
+      offline_jack::run(1);
+    }
+    keep(offline_jack::take_output().size());
+  });
+}
+
+static void bench_drawing() {
+  static KeyboardFrame frame;
+
+  frame.width = KEYBOARD_WIDTH;
+  frame.height = KEYBOARD_HEIGHT;
+  frame.min_note = 21;
+  frame.max_note = 108;
+  frame.enable_keyboard_cue = 1;
+  frame.octave = 4;
+  layout_note_geometry(frame.geometry, frame.min_note, frame.max_note,
+                       frame.width, frame.height);
+  // a chord and a few keys held down
+  for (int note : {48, 52, 55, 60, 64, 67, 72, 73, 90}) {
+    frame.lit.set(note);
+    frame.velocity[note] = 100;
+  }
+
+  bench("get_note_for_xy", [&](size_t n) {
+    int sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+      sum += note_at_xy(frame.geometry, frame.max_note, frame.height,
+                        i % KEYBOARD_WIDTH, (i & 1) ? 10 : 90);
+    keep(sum);
+  });
+
+  if (!any_selected({"render_keyboard"})) return;
+
+  cairo_surface_t* surface = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, frame.width, frame.height);
+  cairo_t* c = cairo_create(surface);
+
+  bench("render_keyboard", [&](size_t n) {
+    for (size_t i = 0; i < n; i++) KeyboardRenderer::render(c, frame);
+    cairo_surface_flush(surface);
+  });
+
+  cairo_destroy(c);
+  cairo_surface_destroy(surface);
+}
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) filters.push_back(argv[i]);
+
+  printf("benchmark,iterations,ns_per_op\n");
+
+  bench_util();
+  bench_csv();
+  bench_keys();
+  bench_engine();
+  bench_drawing();
+
+  return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * Load generator for the MIDI engine, run against the offline JACK stand-in.
+ *
+ * Messages go in at a steady rate, in bursts, either through the queue the
+ * GUI sends with (the output path) or through the midi_in port (the input
+ * path), for every combination of the rates, queue sizes and JACK periods
+ * asked for.  Every message carries a sequence number, so each one that
+ * comes out is matched to when it went in.
+ *
+ * One CSV row is printed per run:
+ *
+ *   path,rate,burst,queue_size,buffer_size,sent,delivered,queue_full,
+ *   dropped,pending,late,mean_error_ms,max_error_ms,high_water
+ *
+ * queue_full counts messages lost to a full queue, as the queue policy
+ * decided, dropped those the engine lost in the process callback, or on
+ * the input path in a full port buffer, and pending those still queued
+ * when the run ended.  high_water
+ * is the most messages that were queued at once.  A message is late if it
+ * came out later than one period after it went in, which is the engine's
+ * normal latency; the error is by how much.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "midiengine.hh"
+#include "offlinejack.hh"
+
+// sequence numbers are sent 14 bits at a time, as a key pressure message
+#define SEQUENCE_BITS 14
+#define SEQUENCE_MASK ((1 << SEQUENCE_BITS) - 1)
+#define STRESS_STATUS 0xA0
+
+struct StressRun {
+  bool input;
+  double rate; /* Messages per second. */
+  int burst;   /* Messages sent at the same time. */
+  size_t queue_size;
+  QueuePolicy queue_policy;
+  jack_nframes_t buffer_size;
+  jack_nframes_t sample_rate;
+  double seconds;
+  double rate_limit;
+  bool running_status;
+};
+
+struct StressResult {
+  size_t sent = 0;
+  size_t delivered = 0;
+  size_t queue_full = 0;
+  size_t dropped = 0;
+  size_t late = 0;
+  double total_error = 0.0; /* In frames. */
+  long max_error = 0;
+  size_t high_water = 0;
+
+  // when each message went in, by sequence number
+  std::vector<jack_nframes_t> sent_at;
+  size_t next_sequence = 0;
+  jack_nframes_t latency = 0;
+};
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: jack-keyboard-stress [-ioS] [-r <rates>] [-B <burst>] "
+          "[-q <queue sizes>] [-b <buffer sizes>] [-s <sample rate>] "
+          "[-d <seconds>] [-l <rate limit>] [-P <queue policy>]\n");
+  fprintf(stderr,
+          "   where <rates> are messages per second, <queue sizes> are in "
+          "messages\n");
+  fprintf(stderr,
+          "   and <buffer sizes> in frames, each a comma separated list "
+          "to sweep.\n");
+  fprintf(stderr,
+          "   -o and -i test only the output or the input path, "
+          "<rate limit>,\n");
+  fprintf(stderr,
+          "   <queue policy> and -S are as for jack-keyboard -r, -Q and "
+          "-S,\n");
+  fprintf(stderr, "   except that <queue policy> can't be block.\n");
+
+  exit(EX_USAGE);
+}
+
+static double parse_number(const char *s) {
+  char *end;
+  double value = strtod(s, &end);
+
+  if (end == s || *end != '\0' || !(value > 0.0)) usage();
+
+  return (value);
+}
+
+static std::vector<double> parse_list(const char *list) {
+  std::vector<double> values;
+  char *copy = strdup(list), *saveptr = NULL;
+
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr))
+    values.push_back(parse_number(item));
+
+  free(copy);
+
+  if (values.empty()) usage();
+
+  return (values);
+}
+
+static MidiMessage stress_message(size_t sequence) {
+  return {0, 3, {STRESS_STATUS, (unsigned char)(sequence & 0x7F),
+                 (unsigned char)((sequence >> 7) & 0x7F)}};
+}
+
+// matches a message that came out at time to the one that went in
+static void deliver(StressResult &result, const unsigned char *data,
+                    jack_nframes_t time) {
+  size_t sequence;
+  long error;
+
+  if (data[0] != STRESS_STATUS) return;
+
+  /* Messages come out in order, the first one at or after the next one
+   * expected with these low bits is the one. */
+  sequence = result.next_sequence +
+             (((data[1] | data[2] << 7) - result.next_sequence) &
+              SEQUENCE_MASK);
+  if (sequence >= result.sent_at.size()) return;
+  result.next_sequence = sequence + 1;
+
+  result.delivered++;
+  error = (long)time - (long)(result.sent_at[sequence] + result.latency);
+  if (error > 0) {
+    result.late++;
+    result.total_error += error;
+    result.max_error = std::max(result.max_error, error);
+  }
+}
+
+static void count_received(const MidiMessage &message, void *data) {
+  StressResult *result = static_cast<StressResult *>(data);
+
+  deliver(*result, message.data,
+          offline_jack::last_frame_time() + message.time);
+}
+
+/*
+ * Runs for the given time, then for as long again at most to let whatever is
+ * still queued out.
+ */
+static StressResult stress(const StressRun &run) {
+  StressResult result;
+  MidiEngine engine({NULL, count_received, NULL, NULL, &result});
+  MidiEngineConfig config;
+  const char *error;
+  const jack_nframes_t nframes = run.buffer_size;
+  const size_t cycles = ceil(run.seconds * run.sample_rate / nframes);
+  const double interval = run.sample_rate / run.rate * run.burst;
+  double next = 0.0;
+
+  offline_jack::configure({run.sample_rate, run.buffer_size});
+  config.client_name = "jack-keyboard-stress";
+  config.queue_size = run.queue_size;
+  config.rate_limit = run.rate_limit;
+  config.queue_policy = run.queue_policy;
+  config.running_status = run.running_status;
+
+  if ((error = engine.open(config)) != NULL ||
+      (error = engine.activate()) != NULL) {
+    fprintf(stderr, "%s\n", error);
+    exit(EX_UNAVAILABLE);
+  }
+
+  // scripted input is delivered as it is, queued output one period later
+  result.latency = run.input ? 0 : nframes;
+
+  for (size_t cycle = 0; cycle < cycles * 2; cycle++) {
+    std::vector<offline_jack::Event> events;
+    /* The GUI queues during the period after the last cycle started, input
+     * arrives during the one about to run. */
+    jack_nframes_t start = run.input ? cycle * nframes
+                                     : offline_jack::last_frame_time();
+
+    engine.flush();
+    while (cycle < cycles && next < start + nframes) {
+      jack_nframes_t time = next;
+
+      offline_jack::set_frame_offset(time - start);
+      for (int i = 0; i < run.burst; i++) {
+        MidiMessage message = stress_message(result.sent_at.size());
+
+        result.sent++;
+        if (run.input) {
+          events.push_back({time, {message.data, message.data + 3}});
+        } else if (!engine.queue_new(message.data[0], message.data[1],
+                                     message.data[2])) {
+          continue;
+        }
+
+        result.sent_at.push_back(time);
+      }
+      next += interval;
+    }
+
+    if (run.input) offline_jack::script_input(events);
+    offline_jack::run(1);
+
+    std::vector<offline_jack::Event> output = offline_jack::take_output();
+    for (const offline_jack::Event &event : output) {
+      if (event.data.size() == 3)
+        deliver(result, event.data.data(), event.time);
+    }
+
+    if (cycle >= cycles && output.empty() && !engine.backlogged()) break;
+  }
+
+  result.queue_full = engine.queue_stats().dropped;
+  result.high_water = engine.queue_stats().high_water;
+  result.dropped = engine.queue_stats().lost;
+
+  // input lost in a full port buffer never reached the engine
+  if (run.input) result.dropped = result.sent - result.delivered;
+
+  return (result);
+}
+
+int main(int argc, char *argv[]) {
+  int ch;
+  bool output = true, input = true;
+  StressRun run = {};
+  std::vector<double> rates = {1000, 10000, 100000};
+  std::vector<double> queue_sizes = {64, 256, 1024};
+  std::vector<double> buffer_sizes = {64, 256, 1024};
+
+  run.burst = 1;
+  run.sample_rate = 48000;
+  run.seconds = 10.0;
+
+  while ((ch = getopt(argc, argv, "ioSr:B:q:b:s:d:l:P:")) != -1) {
+    switch (ch) {
+      case 'i':
+        output = false;
+        break;
+
+      case 'o':
+        input = false;
+        break;
+
+      case 'S':
+        run.running_status = true;
+        break;
+
+      case 'r':
+        rates = parse_list(optarg);
+        break;
+
+      case 'B':
+        run.burst = parse_number(optarg);
+        break;
+
+      case 'q':
+        queue_sizes = parse_list(optarg);
+        break;
+
+      case 'b':
+        buffer_sizes = parse_list(optarg);
+        break;
+
+      case 's':
+        run.sample_rate = parse_number(optarg);
+        break;
+
+      case 'd':
+        run.seconds = parse_number(optarg);
+        break;
+
+      case 'l':
+        run.rate_limit = parse_number(optarg);
+        break;
+
+      case 'P':
+        if (!queue_policy_from_name(optarg, &run.queue_policy)) usage();
+        /* Cycles run on this thread, so nothing would ever make room. */
+        if (run.queue_policy == QUEUE_BLOCK) {
+          fprintf(stderr, "The block policy can't be stress tested.\n");
+          exit(EX_USAGE);
+        }
+        break;
+
+      default:
+        usage();
+    }
+  }
+
+  if (argc != optind || (!input && !output) || run.burst < 1) usage();
+
+  printf(
+      "path,rate,burst,queue_size,buffer_size,sent,delivered,queue_full,"
+      "dropped,pending,late,mean_error_ms,max_error_ms,high_water\n");
+
+  for (int path = 0; path < 2; path++) {
+    run.input = path == 1;
+    if (run.input ? !input : !output) continue;
+
+    for (double rate : rates) {
+      // the queue is not on the input path, one size will do
+      for (double queue_size : run.input ? std::vector<double>{queue_sizes[0]}
+                                         : queue_sizes) {
+        for (double buffer_size : buffer_sizes) {
+          run.rate = rate;
+          run.queue_size = queue_size;
+          run.buffer_size = buffer_size;
+
+          StressResult r = stress(run);
+          double ms = 1000.0 / run.sample_rate;
+
+          printf("%s,%g,%d,%zu,%u,%zu,%zu,%zu,%zu,%zu,%zu,%.3f,%.3f,%zu\n",
+                 run.input ? "input" : "output", run.rate, run.burst,
+                 run.queue_size, run.buffer_size, r.sent, r.delivered,
+                 r.queue_full, r.dropped,
+                 r.sent - r.delivered - r.queue_full - r.dropped, r.late,
+                 r.late ? r.total_error / r.late * ms : 0.0,
+                 r.max_error * ms, r.high_water);
+          fflush(stdout);
+        }
+      }
+    }
+  }
+
+  return (0);
+}
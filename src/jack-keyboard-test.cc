@@ -0,0 +1,270 @@
+/*
+ * Tests of the MIDI engine, run against the offline JACK stand-in, so they
+ * need no jackd and every run is the same.
+ *
+ * Each test is named on the command line, which is how ctest runs them one
+ * by one; with no name, all of them run.  Failed checks are printed, and
+ * make the exit status 1.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "midiengine.hh"
+#include "offlinejack.hh"
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+static int failures;
+
+// opens and activates engine with config, on a fresh offline server
+static bool start(MidiEngine &engine, const MidiEngineConfig &config,
+                  jack_nframes_t buffer_size) {
+  const char *error;
+
+  offline_jack::configure({48000, buffer_size});
+
+  if ((error = engine.open(config)) != NULL ||
+      (error = engine.activate()) != NULL) {
+    fprintf(stderr, "%s\n", error);
+    failures++;
+    return (false);
+  }
+
+  /* A cycle, so frame time is where a running client would see it. */
+  offline_jack::run(1);
+  offline_jack::take_output();
+
+  return (true);
+}
+
+/* Messages go out in the order queued, one period after they were. */
+static void test_output_order() {
+  static const jack_nframes_t offsets[] = {5, 40, 40, 100, 20, 127};
+  const jack_nframes_t nframes = 128;
+  std::vector<offline_jack::Event> expected;
+  std::vector<offline_jack::Event> output;
+  MidiEngine engine;
+  MidiEngineConfig config;
+  int note = 60;
+
+  if (!start(engine, config, nframes)) return;
+
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    /* Ahead of the last offset, into the next period. */
+    if (i > 0 && offsets[i] < offsets[i - 1]) offline_jack::run(1);
+
+    offline_jack::set_frame_offset(offsets[i]);
+    CHECK(engine.queue_new(0x90, note, 100));
+    expected.push_back(
+        {offline_jack::last_frame_time() + offsets[i] + nframes,
+         {0x90, (jack_midi_data_t)note, 100}});
+    note++;
+  }
+
+  offline_jack::run(3);
+  output = offline_jack::take_output();
+
+  CHECK(output.size() == expected.size());
+  for (size_t i = 0; i < output.size() && i < expected.size(); i++) {
+    CHECK(output[i].time == expected[i].time);
+    CHECK(output[i].data == expected[i].data);
+  }
+}
+
+/* A full queue refuses what doesn't fit, counts it, and sends the rest. */
+static void test_queue_full_drops() {
+  MidiEngine engine;
+  MidiEngineConfig config;
+  std::vector<offline_jack::Event> output;
+  size_t capacity, refused = 0;
+
+  config.queue_size = 16;
+  if (!start(engine, config, 256)) return;
+
+  capacity = engine.queue_stats().capacity;
+  CHECK(capacity >= config.queue_size - 1);
+
+  for (size_t i = 0; i < capacity + 10; i++)
+    if (!engine.queue_new(0xB0, 1, i & 0x7F)) refused++;
+
+  CHECK(refused == 10);
+  CHECK(engine.queue_stats().dropped == 10);
+
+  offline_jack::run(4);
+  output = offline_jack::take_output();
+
+  CHECK(output.size() == capacity);
+  for (size_t i = 0; i < output.size(); i++)
+    CHECK(output[i].data[2] == (i & 0x7F));
+}
+
+// queues n note ons, sounding no note twice; how many were refused
+static size_t queue_notes(MidiEngine &engine, size_t n) {
+  size_t refused = 0;
+
+  for (size_t i = 0; i < n; i++)
+    if (!engine.queue_new(0x90, i & 0x7F, 100)) refused++;
+
+  return (refused);
+}
+
+/* The newest message is refused, nothing is held back. */
+static void test_policy_drop_newest() {
+  MidiEngine engine;
+  MidiEngineConfig config;
+  MidiQueueStats stats;
+
+  config.queue_size = 16;
+  config.queue_policy = QUEUE_DROP_NEWEST;
+  if (!start(engine, config, 256)) return;
+
+  CHECK(queue_notes(engine, engine.queue_stats().capacity + 5) == 5);
+
+  stats = engine.queue_stats();
+  CHECK(stats.dropped == 5);
+  CHECK(stats.high_water == stats.capacity);
+  CHECK(stats.backlog == 0);
+
+  offline_jack::run(2);
+  CHECK(offline_jack::take_output().size() == stats.capacity);
+  CHECK(engine.queue_stats().lost == 0);
+}
+
+/* Up to queue_size are held back, and a controller change drops the older
+ * one it overrides; with none to drop, the new message is refused. */
+static void test_policy_drop_oldest_cc() {
+  MidiEngine engine;
+  MidiEngineConfig config;
+  MidiQueueStats stats;
+  std::vector<offline_jack::Event> output;
+  size_t capacity;
+  int volume = 0;
+
+  config.queue_size = 16;
+  config.queue_policy = QUEUE_DROP_OLDEST_CC;
+  if (!start(engine, config, 256)) return;
+
+  capacity = engine.queue_stats().capacity;
+  CHECK(queue_notes(engine, capacity) == 0);
+
+  for (int controller = 0; controller < 16; controller++)
+    CHECK(engine.queue_new(0xB0, controller, 1));
+
+  stats = engine.queue_stats();
+  CHECK(stats.dropped == 0);
+  CHECK(stats.backlog == 16);
+  CHECK(stats.high_water == capacity + 16);
+
+  CHECK(engine.queue_new(0xB0, 0, 2));
+  CHECK(engine.queue_stats().dropped == 1);
+  CHECK(!engine.queue_new(0x90, 100, 100));
+  CHECK(engine.queue_stats().dropped == 2);
+
+  for (int i = 0; i < 10 && engine.backlogged(); i++) {
+    offline_jack::run(1);
+    engine.flush();
+  }
+  offline_jack::run(2);
+
+  stats = engine.queue_stats();
+  CHECK(stats.backlog == 0);
+  CHECK(stats.lost == 0);
+  CHECK(stats.high_water == capacity + 16);
+
+  /* Controller 0 only with the value that overrode the first. */
+  output = offline_jack::take_output();
+  CHECK(output.size() == capacity + 16);
+  for (const offline_jack::Event &event : output)
+    if (event.data[0] == 0xB0 && event.data[1] == 0) volume = event.data[2];
+  CHECK(volume == 2);
+}
+
+/* Waits block_ms for room, none comes without cycles, then refuses. */
+static void test_policy_block() {
+  MidiEngine engine;
+  MidiEngineConfig config;
+  MidiQueueStats stats;
+
+  config.queue_size = 16;
+  config.queue_policy = QUEUE_BLOCK;
+  config.block_ms = 1.0;
+  if (!start(engine, config, 256)) return;
+
+  CHECK(queue_notes(engine, engine.queue_stats().capacity + 2) == 2);
+
+  stats = engine.queue_stats();
+  CHECK(stats.dropped == 2);
+  CHECK(stats.high_water == stats.capacity);
+  CHECK(stats.backlog == 0);
+
+  offline_jack::run(2);
+  CHECK(offline_jack::take_output().size() == stats.capacity);
+  CHECK(engine.queue_stats().lost == 0);
+}
+
+/* A loop playing more at once than can be held back loses, and counts, the
+ * rest; the queue dropped none of it. */
+static void test_lost_in_callback() {
+  const size_t messages = 1100;
+  MidiEngine engine;
+  MidiEngineConfig config;
+  MidiQueueStats stats;
+  size_t played;
+
+  config.queue_size = 2048;
+  if (!start(engine, config, 8192)) return;
+
+  engine.loop(LOOP_RECORD);
+  for (size_t i = 0; i < messages; i++)
+    CHECK(engine.queue_new(0xB0, 1, i & 0x7F));
+  offline_jack::run(2);
+  CHECK(offline_jack::take_output().size() == messages);
+
+  engine.loop(LOOP_RECORD);
+  offline_jack::run(1);
+  played = offline_jack::take_output().size();
+
+  stats = engine.queue_stats();
+  CHECK(stats.lost > 0);
+  CHECK(played + stats.lost == messages);
+  CHECK(stats.dropped == 0);
+}
+
+struct Test {
+  const char *name;
+  void (*run)();
+};
+
+static const Test tests[] = {
+    {"output_order", test_output_order},
+    {"queue_full_drops", test_queue_full_drops},
+    {"policy_drop_newest", test_policy_drop_newest},
+    {"policy_drop_oldest_cc", test_policy_drop_oldest_cc},
+    {"policy_block", test_policy_block},
+    {"lost_in_callback", test_lost_in_callback},
+};
+
+int main(int argc, char **argv) {
+  for (const Test &test : tests) {
+    bool wanted = argc < 2;
+
+    for (int i = 1; i < argc; i++)
+      if (strcmp(argv[i], test.name) == 0) wanted = true;
+
+    if (!wanted) continue;
+
+    printf("%s\n", test.name);
+    test.run();
+  }
+
+  return (failures > 0 ? 1 : 0);
+}
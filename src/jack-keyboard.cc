@@ -37,8 +37,8 @@
 #include <gdk/gdkkeysyms.h>
 #include <gtk/gtk.h>
 #include <jack/jack.h>
-#include <jack/midiport.h>
 #include <jack/ringbuffer.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,10 +51,16 @@
 #include "config.h"
 #endif
 
+#include <atomic>
 #include <filesystem>
 #include <iostream>
 
 #include "easykeyboard.hh"
+#include "keylayout.hh"
+#include "midi.hh"
+#include "midiengine.hh"
+#include "midirecorder.hh"
+#include "notemirror.hh"
 #include "pianokeyboard.hh"
 #include "util.hh"
 
@@ -63,6 +69,7 @@
 #endif
 
 #ifdef HAVE_X11
+#include <X11/XKBlib.h>
 #include <gdk/gdkx.h>
 #endif
 
@@ -81,20 +88,17 @@
 #define PITCH_INIT 0
 #define PITCH_RANGE 8192
 
-#define OUTPUT_PORT_NAME "midi_out"
-#define INPUT_PORT_NAME "midi_in"
 #define PACKAGE_NAME "jack-keyboard"
 #define PACKAGE_VERSION "2.7.2"
 
-jack_port_t *output_port;
-jack_port_t *input_port;
 int entered_number = -1;
 int allow_connecting_to_own_kind = 0;
 int enable_gui = 1;
 int grab_keyboard_at_startup = 0;
 volatile int keyboard_grabbed = 0;
 int enable_window_title = 0;
-int time_offsets_are_zero = 0;
+/* Set if the X server does not send KeyRelease events for autorepeat. */
+int detectable_autorepeat = 0;
 int send_program_change_at_reconnect = 0;
 int send_program_change_once = 0;
 int program_change_was_sent = 0;
@@ -103,8 +107,6 @@ int velocity_normal = VELOCITY_NORMAL;
 int velocity_low = VELOCITY_LOW;
 int *current_velocity = &velocity_normal;
 int octave = 4;
-double rate_limit = 0.0;
-jack_client_t *jack_client = NULL;
 const std::string HOME_DIR = getenv("HOME");
 const std::filesystem::path STYLE_PATH = HOME_DIR + "/.jack-keyboard/main.rc";
 
@@ -114,20 +116,6 @@ lash_client_t *lash_client;
 
 static void panic(void);
 
-#define MIDI_NOTE_ON 0x90
-#define MIDI_NOTE_OFF 0x80
-#define MIDI_PROGRAM_CHANGE 0xC0
-#define MIDI_CONTROLLER 0xB0
-#define MIDI_PITCH 0xE0
-#define MIDI_RESET 0xFF
-#define MIDI_HOLD_PEDAL 64
-#define MIDI_ALL_SOUND_OFF 120
-#define MIDI_ALL_MIDI_CONTROLLERS_OFF 121
-#define MIDI_ALL_NOTES_OFF 123
-#define MIDI_BANK_SELECT_MSB 0
-#define MIDI_BANK_SELECT_LSB 32
-#define MIDI_MOD_CC 1
-
 #define BANK_MIN 0
 #define BANK_MAX 127
 #define PROGRAM_MIN 0
@@ -141,80 +129,45 @@ GtkWidget *window, *sustain_button, *channel_spin, *bank_spin, *program_spin,
 PianoKeyboard *keyboard;
 GtkListStore *connected_to_store;
 keymap::KeyMap *functions_keymap;
+/* Keys held down that fired a binding, by keycode, so repeats don't. */
+BitSet<NKEYCODES> bound_keys_down;
 
 #ifdef HAVE_X11
 Display *dpy;
 #endif
 
-struct MidiMessage {
-  jack_nframes_t time;
-  int len; /* Length of MIDI message, in bytes. */
-  unsigned char data[3];
-};
-
-#define RINGBUFFER_SIZE 1024 * sizeof(struct MidiMessage)
-
-/* Will emit a warning if time between jack callbacks is longer than this. */
-#define MAX_TIME_BETWEEN_CALLBACKS 0.1
-
-/* Will emit a warning if execution of jack callback takes longer than this. */
-#define MAX_PROCESSING_TIME 0.01
-
-jack_ringbuffer_t *ringbuffer;
-
 /* Number of currently used program. */
 int program = 0;
 
 /* Number of currently selected bank. */
 int bank = 0;
 
-/* Number of currently selected channel (0..15). */
-int channel = 0;
-
-void draw_note(int key);
-void queue_message(struct MidiMessage *ev);
-
-double get_time(void) {
-  double seconds;
-  int ret;
-  struct timeval tv;
+static void engine_warning(const char *message, void *notused);
+static void engine_received(const MidiMessage &message, void *notused);
+static void engine_graph_changed(void *notused);
+static void engine_sent(jack_nframes_t time, const unsigned char *message,
+                        int len, void *notused);
 
-  ret = gettimeofday(&tv, NULL);
-
-  if (ret) {
-    perror("gettimeofday");
-    exit(EX_OSERR);
-  }
+/* Where -w records to; destroyed after the engine, which records into it. */
+const char *record_path = NULL;
+MidiRecorder recorder;
 
-  seconds = tv.tv_sec + tv.tv_usec / 1000000.0;
+/* JACK client, ports and output queue; opened in init_jack(). */
+MidiEngineConfig engine_config;
+MidiEngine engine{
+    {engine_warning, engine_received, engine_graph_changed, engine_sent}};
 
-  return (seconds);
-}
-
-double get_delta_time(void) {
-  static double previously = -1.0;
-  double now;
-  double delta;
-
-  now = get_time();
-
-  if (previously == -1.0) {
-    previously = now;
-
-    return (0);
-  }
-
-  delta = now - previously;
-  previously = now;
-
-  assert(delta >= 0.0);
+void draw_note(int key);
+void queue_message(struct MidiMessage *ev);
 
-  return (delta);
-}
+/* Messages from midi_in, on their way from the JACK thread to this one. */
+#define RECEIVED_QUEUE_SIZE 256
+jack_ringbuffer_t *received_queue = NULL;
+std::atomic<bool> received_pending = false;
+std::atomic<size_t> received_lost = 0;
 
-gboolean process_received_message_async(gpointer evp) {
-  int i;
-  struct MidiMessage *ev = (struct MidiMessage *)evp;
+void process_received_message(struct MidiMessage *ev) {
+  gboolean forward = TRUE;
   int b0 = ev->data[0];
   int b1 = ev->data[1];
 
@@ -224,44 +177,45 @@ gboolean process_received_message_async(gpointer evp) {
   if (b0 == MIDI_RESET ||
       (b0 == MIDI_CONTROLLER &&
        (b1 == MIDI_ALL_NOTES_OFF || b1 == MIDI_ALL_SOUND_OFF))) {
-    for (i = 0; i < NNOTES; i++) {
-      piano_keyboard_set_note_off(keyboard, i);
-    }
+    piano_keyboard_set_all_notes_off(keyboard);
   }
 
+  /* Only pass on note messages that change what is sounding; the same note
+   * may be held from the keyboard or mouse at the same time. */
   if (b0 == MIDI_NOTE_ON) {
     if (ev->data[2] == 0)
-      piano_keyboard_set_note_off(keyboard, ev->data[1]);
+      forward = piano_keyboard_set_note_off(keyboard, ev->data[1]);
     else
-      piano_keyboard_set_note_on(keyboard, ev->data[1], ev->data[2]);
+      forward = piano_keyboard_set_note_on(keyboard, ev->data[1], ev->data[2]);
   }
 
   if (b0 == MIDI_NOTE_OFF) {
-    piano_keyboard_set_note_off(keyboard, ev->data[1]);
+    forward = piano_keyboard_set_note_off(keyboard, ev->data[1]);
   }
 
-  ev->data[0] = b0 | channel;
-  queue_message(ev);
-
-  return (FALSE);
+  /* Channel messages are passed on on our channel, system ones as they are. */
+  if (forward) {
+    if (b0 < 0xF0) ev->data[0] = b0 | engine.channel();
+    queue_message(ev);
+  }
 }
 
-struct MidiMessage *midi_message_from_midi_event(jack_midi_event_t event) {
-  struct MidiMessage *ev = new MidiMessage();
-
-  if (ev == NULL) {
-    perror("malloc");
-    return (NULL);
-  }
+gboolean process_received_messages_async(gpointer notused) {
+  struct MidiMessage ev;
+  size_t lost;
 
-  assert(event.size >= 1 && event.size <= 3);
+  /* Cleared first: whatever arrives from now on needs another call. */
+  received_pending = false;
 
-  ev->len = event.size;
-  ev->time = event.time;
+  while (jack_ringbuffer_read(received_queue, (char *)&ev, sizeof(ev)) ==
+         sizeof(ev))
+    process_received_message(&ev);
 
-  memcpy(ev->data, event.buffer, ev->len);
+  lost = received_lost.exchange(0);
+  if (lost > 0)
+    g_warning("%zu received messages lost, the GUI could not keep up.", lost);
 
-  return (ev);
+  return (FALSE);
 }
 
 gboolean warning_async(gpointer s) {
@@ -272,210 +226,49 @@ gboolean warning_async(gpointer s) {
   return (FALSE);
 }
 
-void warn_from_jack_thread_context(const char *str) {
-  g_idle_add(warning_async, (gpointer)str);
-}
-
-void process_midi_input(jack_nframes_t nframes) {
-  int read, events, i;
-  void *port_buffer;
-  jack_midi_event_t event;
-
-  port_buffer = jack_port_get_buffer(input_port, nframes);
-  if (port_buffer == NULL) {
-    warn_from_jack_thread_context(
-        "jack_port_get_buffer failed, cannot receive anything.");
-    return;
-  }
-
-#ifdef JACK_MIDI_NEEDS_NFRAMES
-  events = jack_midi_get_event_count(port_buffer, nframes);
-#else
-  events = jack_midi_get_event_count(port_buffer);
-#endif
-
-  for (i = 0; i < events; i++) {
-    struct MidiMessage *rev;
-
-#ifdef JACK_MIDI_NEEDS_NFRAMES
-    read = jack_midi_event_get(&event, port_buffer, i, nframes);
-#else
-    read = jack_midi_event_get(&event, port_buffer, i);
-#endif
-    if (read) {
-      warn_from_jack_thread_context(
-          "jack_midi_event_get failed, RECEIVED NOTE LOST.");
-      continue;
-    }
-
-    if (event.size > 3) {
-      warn_from_jack_thread_context(
-          "Ignoring MIDI message longer than three bytes, probably a SysEx.");
-      continue;
-    }
-
-    rev = midi_message_from_midi_event(event);
-    if (rev == NULL) {
-      warn_from_jack_thread_context(
-          "midi_message_from_midi_event failed, RECEIVED NOTE LOST.");
-      continue;
-    }
-
-    g_idle_add(process_received_message_async, rev);
-  }
-}
+/* Messages lost to a full output queue and not reported yet. */
+size_t unreported_drops = 0;
+guint flush_source = 0;
 
-double nframes_to_ms(jack_nframes_t nframes) {
-  jack_nframes_t sr;
+/* Only on stderr; a dialog would stall the GUI when it is busy already. */
+gboolean report_dropped_messages(gpointer notused) {
+  MidiQueueStats stats = engine.queue_stats();
 
-  sr = jack_get_sample_rate(jack_client);
+  g_warning(
+      "Output queue full, %zu messages lost (%zu in all; %zu of %zu queued at "
+      "most).",
+      unreported_drops, stats.dropped, stats.high_water, stats.capacity);
 
-  assert(sr > 0);
+  unreported_drops = 0;
 
-  return ((nframes * 1000.0) / (double)sr);
+  return (FALSE);
 }
 
-void process_midi_output(jack_nframes_t nframes) {
-  int read, t, bytes_remaining;
-  unsigned char *buffer;
-  void *port_buffer;
-  jack_nframes_t last_frame_time;
-  struct MidiMessage ev;
-
-  last_frame_time = jack_last_frame_time(jack_client);
-
-  port_buffer = jack_port_get_buffer(output_port, nframes);
-  if (port_buffer == NULL) {
-    warn_from_jack_thread_context(
-        "jack_port_get_buffer failed, cannot send anything.");
-    return;
-  }
-
-#ifdef JACK_MIDI_NEEDS_NFRAMES
-  jack_midi_clear_buffer(port_buffer, nframes);
-#else
-  jack_midi_clear_buffer(port_buffer);
-#endif
+gboolean flush_queue(gpointer notused) {
+  engine.flush();
 
-  /* We may push at most one byte per 0.32ms to stay below 31.25 Kbaud limit. */
-  bytes_remaining = nframes_to_ms(nframes) * rate_limit;
+  if (engine.backlogged()) return (TRUE);
 
-  while (jack_ringbuffer_read_space(ringbuffer)) {
-    read = jack_ringbuffer_peek(ringbuffer, (char *)&ev, sizeof(ev));
+  flush_source = 0;
 
-    if (read != sizeof(ev)) {
-      warn_from_jack_thread_context(
-          "Short read from the ringbuffer, possible note loss.");
-      jack_ringbuffer_read_advance(ringbuffer, read);
-      continue;
-    }
-
-    bytes_remaining -= ev.len;
-
-    if (rate_limit > 0.0 && bytes_remaining <= 0) {
-      warn_from_jack_thread_context("Rate limiting in effect.");
-      break;
-    }
-
-    t = ev.time + nframes - last_frame_time;
-
-    /* If computed time is too much into the future, we'll need
-       to send it later. */
-    if (t >= (int)nframes) break;
-
-    /* If computed time is < 0, we missed a cycle because of xrun. */
-    if (t < 0) t = 0;
-
-    if (time_offsets_are_zero) t = 0;
-
-    jack_ringbuffer_read_advance(ringbuffer, sizeof(ev));
-
-#ifdef JACK_MIDI_NEEDS_NFRAMES
-    buffer = jack_midi_event_reserve(port_buffer, t, ev.len, nframes);
-#else
-    buffer = jack_midi_event_reserve(port_buffer, t, ev.len);
-#endif
-
-    if (buffer == NULL) {
-      warn_from_jack_thread_context(
-          "jack_midi_event_reserve failed, NOTE LOST.");
-      break;
-    }
-
-    memcpy(buffer, ev.data, ev.len);
-  }
+  return (FALSE);
 }
 
-int process_callback(jack_nframes_t nframes, void *notused) {
-#ifdef MEASURE_TIME
-  if (get_delta_time() > MAX_TIME_BETWEEN_CALLBACKS)
-    warn_from_jack_thread_context(
-        "Had to wait too long for JACK callback; scheduling problem?");
-#endif
-
-  /* Check for impossible condition that actually happened to me, caused by some
-   * problem between jackd and OSS4. */
-  if (nframes <= 0) {
-    warn_from_jack_thread_context(
-        "Process callback called with nframes = 0; bug in JACK?");
-    return 0;
-  }
-
-  process_midi_input(nframes);
-  process_midi_output(nframes);
+void message_queued(bool queued) {
+  /* Bursts of lost messages are reported once a second at most. */
+  if (!queued && unreported_drops++ == 0)
+    g_timeout_add(1000, report_dropped_messages, NULL);
 
-#ifdef MEASURE_TIME
-  if (get_delta_time() > MAX_PROCESSING_TIME)
-    warn_from_jack_thread_context(
-        "Processing took too long; scheduling problem?");
-#endif
-
-  return (0);
+  if (engine.backlogged() && flush_source == 0)
+    flush_source = g_timeout_add(2, flush_queue, NULL);
 }
 
 void queue_message(struct MidiMessage *ev) {
-  int written;
-
-  if (jack_ringbuffer_write_space(ringbuffer) < sizeof(*ev)) {
-    g_critical("Not enough space in the ringbuffer, NOTE LOST.");
-    return;
-  }
-
-  written = jack_ringbuffer_write(ringbuffer, (char *)ev, sizeof(*ev));
-
-  if (written != sizeof(*ev))
-    g_warning("jack_ringbuffer_write failed, NOTE LOST.");
+  message_queued(engine.queue(*ev));
 }
 
 void queue_new_message(int b0, int b1, int b2) {
-  struct MidiMessage ev;
-
-  /* For MIDI messages that specify a channel number, filter the original
-     channel number out and add our own. */
-  if (b0 >= 0x80 && b0 <= 0xEF) {
-    b0 &= 0xF0;
-    b0 += channel;
-  }
-
-  if (b1 == -1) {
-    ev.len = 1;
-    ev.data[0] = b0;
-
-  } else if (b2 == -1) {
-    ev.len = 2;
-    ev.data[0] = b0;
-    ev.data[1] = b1;
-
-  } else {
-    ev.len = 3;
-    ev.data[0] = b0;
-    ev.data[1] = b1;
-    ev.data[2] = b2;
-  }
-
-  ev.time = jack_frame_time(jack_client);
-
-  queue_message(&ev);
+  message_queued(engine.queue_new(b0, b1, b2));
 }
 
 gboolean update_connected_to_combo_async(gpointer notused) {
@@ -483,12 +276,12 @@ gboolean update_connected_to_combo_async(gpointer notused) {
   const char **connected, **available, *my_name;
   GtkTreeIter iter;
 
-  if (jack_client == NULL || output_port == NULL) return (FALSE);
+  if (engine.client() == NULL || engine.output_port() == NULL) return (FALSE);
 
-  connected = jack_port_get_connections(output_port);
-  available = jack_get_ports(jack_client, NULL, JACK_DEFAULT_MIDI_TYPE,
+  connected = jack_port_get_connections(engine.output_port());
+  available = jack_get_ports(engine.client(), NULL, JACK_DEFAULT_MIDI_TYPE,
                              JackPortIsInput);
-  my_name = jack_port_name(input_port);
+  my_name = jack_port_name(engine.input_port());
 
   assert(my_name);
 
@@ -528,6 +321,10 @@ gboolean update_connected_to_combo_async(gpointer notused) {
   return (FALSE);
 }
 
+/* By LoopState. */
+static const char *loop_state_names[] = {"empty", "recording", "playing",
+                                         "overdubbing", "stopped"};
+
 void draw_window_title(void) {
   int i, off = 0;
   char title[256];
@@ -535,12 +332,13 @@ void draw_window_title(void) {
 
   if (window == NULL) return;
 
-  if (enable_window_title && jack_client != NULL) {
-    connected_ports = jack_port_get_connections(output_port);
+  if (enable_window_title && engine.client() != NULL) {
+    connected_ports = jack_port_get_connections(engine.output_port());
 
     off += snprintf(
         title, sizeof(title) - off, "%s: channel %d, bank %d, program %d",
-        jack_get_client_name(jack_client), channel + 1, bank, program);
+        jack_get_client_name(engine.client()), engine.channel() + 1, bank,
+        program);
 
     if (!program_change_was_sent)
       off += snprintf(title + off, sizeof(title) - off,
@@ -560,12 +358,16 @@ void draw_window_title(void) {
 
     if (connected_ports != NULL) free(connected_ports);
 
+    if (engine.loop_state() != LOOP_EMPTY)
+      off += snprintf(title + off, sizeof(title) - off, ", loop %s",
+                      loop_state_names[engine.loop_state()]);
+
     gtk_window_set_title(GTK_WINDOW(window), title);
   } else {
     /* May be null if JACK is not initialized yet. */
-    if (jack_client != NULL)
+    if (engine.client() != NULL)
       gtk_window_set_title(GTK_WINDOW(window),
-                           jack_get_client_name(jack_client));
+                           jack_get_client_name(engine.client()));
     else
       gtk_window_set_title(GTK_WINDOW(window), PACKAGE_NAME);
   }
@@ -577,19 +379,45 @@ gboolean update_window_title_async(gpointer notused) {
   return (FALSE);
 }
 
-int graph_order_callback(void *notused) {
+/* Engine hooks, called from the JACK thread. */
+
+static void engine_warning(const char *message, void *notused) {
+  g_idle_add(warning_async, (gpointer)message);
+}
+
+/* One idle callback takes everything that arrived until it runs. */
+static void engine_received(const MidiMessage &message, void *notused) {
+  if (jack_ringbuffer_write_space(received_queue) < sizeof(message))
+    received_lost++;
+  else
+    jack_ringbuffer_write(received_queue, (const char *)&message,
+                          sizeof(message));
+
+  if (!received_pending.exchange(true))
+    g_idle_add(process_received_messages_async, NULL);
+}
+
+static void engine_graph_changed(void *notused) {
   g_idle_add(update_window_title_async, NULL);
   g_idle_add(update_connected_to_combo_async, NULL);
+}
 
-  return (0);
+static void engine_sent(jack_nframes_t time, const unsigned char *message,
+                        int len, void *notused) {
+  recorder.record(time, message, len);
 }
 
 void send_program_change(void) {
-  if (jack_port_connected(output_port) == 0) return;
+  if (jack_port_connected(engine.output_port()) == 0) return;
+
+  /* Published together, so the program change never lags its bank. */
+  MidiMessage messages[] = {
+      engine.new_message(MIDI_CONTROLLER, MIDI_BANK_SELECT_LSB, bank % 128),
+      engine.new_message(MIDI_CONTROLLER, MIDI_BANK_SELECT_MSB, bank / 128),
+      engine.new_message(MIDI_PROGRAM_CHANGE, program, -1),
+  };
 
-  queue_new_message(MIDI_CONTROLLER, MIDI_BANK_SELECT_LSB, bank % 128);
-  queue_new_message(MIDI_CONTROLLER, MIDI_BANK_SELECT_MSB, bank / 128);
-  queue_new_message(MIDI_PROGRAM_CHANGE, program, -1);
+  message_queued(engine.queue_batch(messages));
 
   program_change_was_sent = 1;
 }
@@ -599,21 +427,23 @@ void send_program_change(void) {
 int connect_to_input_port(const char *port) {
   int ret;
 
-  if (!strcmp(port, jack_port_name(input_port))) return (-1);
+  if (!strcmp(port, jack_port_name(engine.input_port()))) return (-1);
 
   if (!allow_connecting_to_own_kind) {
-    if (!strncmp(port, jack_port_name(input_port), strlen(PACKAGE_NAME)))
+    if (!strncmp(port, jack_port_name(engine.input_port()),
+                 strlen(PACKAGE_NAME)))
       return (-2);
   }
 
-  ret = jack_port_disconnect(jack_client, output_port);
+  ret = jack_port_disconnect(engine.client(), engine.output_port());
   if (ret) {
     g_warning("Cannot disconnect MIDI port.");
 
     return (-3);
   }
 
-  ret = jack_connect(jack_client, jack_port_name(output_port), port);
+  ret = jack_connect(engine.client(), jack_port_name(engine.output_port()),
+                     port);
   if (ret) {
     g_warning("Cannot connect to %s.", port);
 
@@ -641,7 +471,7 @@ void connect_to_another_input_port(int up_not_down) {
   int i, max, current_index;
 
   available_midi_ports = jack_get_ports(
-      jack_client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
+      engine.client(), NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput);
 
   /* There will be at least one listening MIDI port - the one we create. */
   assert(available_midi_ports);
@@ -662,7 +492,7 @@ void connect_to_another_input_port(int up_not_down) {
     return;
   }
 
-  connected_ports = jack_port_get_connections(output_port);
+  connected_ports = jack_port_get_connections(engine.output_port());
 
   if (connected_ports != NULL && connected_ports[0] != NULL)
     current = connected_ports[0];
@@ -721,67 +551,47 @@ void connect_to_next_input_port(void) { connect_to_another_input_port(1); }
 void connect_to_prev_input_port(void) { connect_to_another_input_port(0); }
 
 void init_jack(void) {
-  int err;
+  const char *err;
 
 #ifdef HAVE_LASH
   lash_event_t *event;
 #endif
 
-  jack_client = jack_client_open(PACKAGE_NAME, JackNoStartServer, NULL);
-
-  if (jack_client == NULL) {
-    g_critical("Could not connect to the JACK server; run jackd first?");
+  received_queue =
+      jack_ringbuffer_create(RECEIVED_QUEUE_SIZE * sizeof(MidiMessage));
+  if (received_queue == NULL) {
+    g_critical("Cannot create JACK ringbuffer.");
     exit(EX_UNAVAILABLE);
   }
 
-  ringbuffer = jack_ringbuffer_create(RINGBUFFER_SIZE);
+  jack_ringbuffer_mlock(received_queue);
 
-  if (ringbuffer == NULL) {
-    g_critical("Cannot create JACK ringbuffer.");
-    exit(EX_SOFTWARE);
+  err = engine.open(engine_config);
+  if (err) {
+    g_critical("%s", err);
+    exit(EX_UNAVAILABLE);
   }
 
-  jack_ringbuffer_mlock(ringbuffer);
+  if (record_path != NULL) {
+    err = recorder.open(record_path, jack_get_sample_rate(engine.client()));
+    if (err) {
+      g_critical("%s", err);
+      exit(EX_CANTCREAT);
+    }
+  }
 
 #ifdef HAVE_LASH
   event = lash_event_new_with_type(LASH_Client_Name);
   assert(event); /* Documentation does not say anything about return value. */
-  lash_event_set_string(event, jack_get_client_name(jack_client));
+  lash_event_set_string(event, jack_get_client_name(engine.client()));
   lash_send_event(lash_client, event);
 
-  lash_jack_client_name(lash_client, jack_get_client_name(jack_client));
+  lash_jack_client_name(lash_client, jack_get_client_name(engine.client()));
 #endif
 
-  err = jack_set_process_callback(jack_client, process_callback, 0);
+  err = engine.activate();
   if (err) {
-    g_critical("Could not register JACK process callback.");
-    exit(EX_UNAVAILABLE);
-  }
-
-  err = jack_set_graph_order_callback(jack_client, graph_order_callback, 0);
-  if (err) {
-    g_critical("Could not register JACK graph order callback.");
-    exit(EX_UNAVAILABLE);
-  }
-
-  output_port = jack_port_register(jack_client, OUTPUT_PORT_NAME,
-                                   JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-
-  if (output_port == NULL) {
-    g_critical("Could not register JACK output port.");
-    exit(EX_UNAVAILABLE);
-  }
-
-  input_port = jack_port_register(jack_client, INPUT_PORT_NAME,
-                                  JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
-
-  if (input_port == NULL) {
-    g_critical("Could not register JACK input port.");
-    exit(EX_UNAVAILABLE);
-  }
-
-  if (jack_activate(jack_client)) {
-    g_critical("Cannot activate JACK client.");
+    g_critical("%s", err);
     exit(EX_UNAVAILABLE);
   }
 }
@@ -888,7 +698,7 @@ void save_config_int(const char *name, int value) {
 }
 
 void save_config_into_lash(void) {
-  save_config_int("channel", channel + 1);
+  save_config_int("channel", engine.channel() + 1);
   save_config_int("bank", bank);
   save_config_int("program", program);
   save_config_int("keyboard_grabbed", keyboard_grabbed);
@@ -959,7 +769,7 @@ gboolean sustain_event_handler(GtkToggleButton *widget, gpointer pressed) {
 }
 
 void channel_event_handler(GtkSpinButton *spinbutton, gpointer notused) {
-  channel = gtk_spin_button_get_value(spinbutton) - 1;
+  engine.set_channel(gtk_spin_button_get_value(spinbutton) - 1);
 
   draw_window_title();
 }
@@ -990,7 +800,7 @@ void connected_to_event_handler(GtkComboBox *widget, gpointer notused) {
   gtk_tree_model_get(GTK_TREE_MODEL(connected_to_store), &iter, 0, &connect_to,
                      -1);
 
-  connected_ports = jack_port_get_connections(output_port);
+  connected_ports = jack_port_get_connections(engine.output_port());
   if (connected_ports != NULL && connected_ports[0] != NULL &&
       !strcmp(connect_to, connected_ports[0])) {
     free(connected_ports);
@@ -1011,14 +821,15 @@ void velocity_event_handler(GtkRange *range, gpointer notused) {
 
 void mod_event_handler(GtkRange *range, gpointer notused) {
   int val = (int)gtk_range_get_value(range);
-  queue_new_message(MIDI_CONTROLLER, MIDI_MOD_CC, val);
+  /* Dragging sends only the latest value each cycle. */
+  engine.set_controller(MIDI_MOD_CC, val);
 }
 
 void pitch_event_handler(GtkRange *range, gpointer notused) {
   uint16_t val = (uint16_t)(gtk_range_get_value(range) *
                                 ((float)PITCH_RANGE / (float)PITCH_MAX) +
                             (float)PITCH_RANGE);
-  queue_new_message(MIDI_PITCH, val & 127, (val >> 7) & 127);
+  engine.set_pitch_bend(val);
 }
 
 void panic_event_handler(GtkWidget *widget) { panic(); }
@@ -1127,8 +938,59 @@ void grab_keyboard(void) {
   gdk_window_add_filter(NULL, keyboard_grab_filter, NULL);
 }
 
+/*
+ * By default X autorepeat sends a KeyRelease/KeyPress pair for every repeat.
+ * Ask XKB to send only the KeyPress events, so that a held key is one press
+ * and one release.
+ */
+void enable_detectable_autorepeat(void) {
+  Bool supported = False;
+  Display *display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+
+  if (XkbSetDetectableAutoRepeat(display, True, &supported) && supported)
+    detectable_autorepeat = 1;
+}
+
+/*
+ * Fallback for servers without detectable autorepeat: a repeat shows up as a
+ * KeyRelease immediately followed by a KeyPress of the same key, with the
+ * same timestamp.
+ */
+int is_autorepeat_release(GdkEventKey *event) {
+  int repeat = 0;
+  GdkEvent *next;
+  Display *display;
+  XEvent xnext;
+
+  if (detectable_autorepeat || event->type != GDK_KEY_RELEASE) return (0);
+
+  /* The next event may have been translated by GDK already. */
+  next = gdk_event_peek();
+  if (next != NULL) {
+    repeat = next->type == GDK_KEY_PRESS &&
+             next->key.hardware_keycode == event->hardware_keycode &&
+             next->key.time == event->time;
+    gdk_event_free(next);
+
+    return (repeat);
+  }
+
+  display = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
+  if (XEventsQueued(display, QueuedAfterReading) == 0) return (0);
+
+  XPeekEvent(display, &xnext);
+
+  return (xnext.type == KeyPress &&
+          xnext.xkey.keycode == event->hardware_keycode &&
+          xnext.xkey.time == event->time);
+}
+
 #else /* ! HAVE_X11 */
 
+void enable_detectable_autorepeat(void) {}
+
+int is_autorepeat_release(GdkEventKey *event) { return (0); }
+
 void ungrab_keyboard(void) {}
 
 void grab_keyboard(void) {
@@ -1164,15 +1026,20 @@ static void panic(void) {
 
   for (i = 0; i < NNOTES; i++) {
     queue_new_message(MIDI_NOTE_OFF, i, 0);
-    piano_keyboard_set_note_off(keyboard, i);
     usleep(100);
   }
 
-  queue_new_message(MIDI_CONTROLLER, MIDI_HOLD_PEDAL, 0);
-  queue_new_message(MIDI_CONTROLLER, MIDI_ALL_MIDI_CONTROLLERS_OFF, 0);
-  queue_new_message(MIDI_CONTROLLER, MIDI_ALL_NOTES_OFF, 0);
-  queue_new_message(MIDI_CONTROLLER, MIDI_ALL_SOUND_OFF, 0);
-  queue_new_message(MIDI_RESET, -1, -1);
+  piano_keyboard_set_all_notes_off(keyboard);
+
+  MidiMessage reset[] = {
+      engine.new_message(MIDI_CONTROLLER, MIDI_HOLD_PEDAL, 0),
+      engine.new_message(MIDI_CONTROLLER, MIDI_ALL_MIDI_CONTROLLERS_OFF, 0),
+      engine.new_message(MIDI_CONTROLLER, MIDI_ALL_NOTES_OFF, 0),
+      engine.new_message(MIDI_CONTROLLER, MIDI_ALL_SOUND_OFF, 0),
+      engine.new_message(MIDI_RESET, -1, -1),
+  };
+
+  message_queued(engine.queue_batch(reset));
 }
 
 void add_digit(int digit) {
@@ -1280,6 +1147,10 @@ gint keyboard_event_handler(GtkWidget *widget, GdkEventKey *event,
   int tmp;
   gboolean retval = FALSE;
 
+  /* Swallow the release half of an autorepeat; the press that follows is
+   * then ignored as a repeat, both for notes and for sustain. */
+  if (is_autorepeat_release(event)) return (TRUE);
+
   /* Pass signal to piano_keyboard widget.  Is there a better way to do this? */
   if (event->type == GDK_KEY_PRESS)
     g_signal_emit_by_name(keyboard, "key-press-event", event, &retval);
@@ -1290,9 +1161,23 @@ gint keyboard_event_handler(GtkWidget *widget, GdkEventKey *event,
 
   if (maybe_add_digit(event)) return (TRUE);
 
-  std::string pressed(1, event->keyval);
-  if (event->type == GDK_KEY_PRESS) {
-    if (functions_keymap->callback(pressed, event)) {
+  /* Bindings are by key name, as keyvals of function keys don't fit a char.
+   * Those marked once act once per press, so holding F9 doesn't toggle
+   * recording; the others repeat, as "=" and "-" do. */
+  const gchar *pressed = gdk_keyval_name(event->keyval);
+  guint16 keycode = event->hardware_keycode;
+  if (event->type == GDK_KEY_RELEASE) {
+    if (keycode < NKEYCODES && bound_keys_down.test(keycode)) {
+      bound_keys_down.reset(keycode);
+      return (TRUE);
+    }
+  } else if (pressed != NULL) {
+    if (keycode < NKEYCODES && bound_keys_down.test(keycode)) return (TRUE);
+
+    const keymap::KeyBind *bind = functions_keymap->find(pressed);
+    if (bind != NULL) {
+      bind->callback(event, bind->data);
+      if (bind->once && keycode < NKEYCODES) bound_keys_down.set(keycode);
       return (TRUE);
     }
   }
@@ -1719,14 +1604,41 @@ void show_version(void) {
 
 void usage(void) {
   fprintf(stderr,
-          "usage: jack-keyboard [-CGKTVkturf] [ -a <input port>] [-c "
-          "<channel>] [-b <bank> ] [-p <program>] [-l <layout>]\n");
+          "usage: jack-keyboard [-CGKSTVkturf] [ -a <input port>] [-c "
+          "<channel>] [-b <bank> ] [-p <program>] [-l <layout>] "
+          "[-q <queue size>] [-Q <queue policy>] [-R <frames>] "
+          "[-F <filter>] [-g <grid>[,<strength>]] [-A <arpeggio>] "
+          "[-w <file>]\n");
   fprintf(
       stderr,
       "   where <channel> is MIDI channel to use for output, from 1 to 16,\n");
   fprintf(stderr, "   <bank> is MIDI bank to use, from 0 to 16383,\n");
   fprintf(stderr, "   <program> is MIDI program to use, from 0 to 127,\n");
-  fprintf(stderr, "   and <layout> is QWERTY.\n");
+  fprintf(stderr, "   <layout> is one of %s,\n", key_layout_names().c_str());
+  fprintf(stderr,
+          "   <queue size> is how many messages wait for JACK, rounded up "
+          "to a power of two,\n"
+          "   less one, 1024 by default,\n");
+  fprintf(stderr,
+          "   <queue policy> is drop-newest, drop-oldest-cc or block,\n");
+  fprintf(stderr,
+          "   <frames> is the spacing of the steps that smooth the pitch "
+          "and\n");
+  fprintf(stderr, "   modulation sliders, 0 for none,\n");
+  fprintf(stderr,
+          "   <filter> lists the incoming messages to ignore, such as "
+          "clock,sensing,\n");
+  fprintf(stderr,
+          "   <grid> is the note value to quantize to while the JACK "
+          "transport\n");
+  fprintf(stderr,
+          "   rolls, 16 for sixteenths, <strength> how far, from 0 to 1,\n");
+  fprintf(stderr,
+          "   <arpeggio> is up, down, random or as-played, then "
+          "optionally\n");
+  fprintf(stderr, "   ,octaves,rate,gate,tempo as in up,2,16,0.5,120,\n");
+  fprintf(stderr,
+          "   and <file> is a MIDI file to record what is played to.\n");
   fprintf(stderr, "See manual page for details.\n");
 
   exit(EX_USAGE);
@@ -1744,12 +1656,19 @@ void keybind_callback_octave_down(void *event, void *data) {
   }
 }
 
+/* The looper acts on its next cycle; the title shows it once it has. */
+void keybind_callback_loop(void *event, void *data) {
+  engine.loop((LoopAction)(intptr_t)data);
+  g_timeout_add(100, update_window_title_async, NULL);
+}
+
 void keybind_destructor_null(void *data) {}
 
 int main(int argc, char *argv[]) {
   int ch, enable_keyboard_cue = 0, initial_channel = 1, initial_bank = 0,
           initial_program = 0, full_midi_keyboard = 0;
   char *keyboard_layout = NULL, *autoconnect_port_name = NULL;
+  const char *err;
 
 #ifdef HAVE_LASH
   lash_args_t *lash_args;
@@ -1763,9 +1682,12 @@ int main(int argc, char *argv[]) {
 
   init_gtk_1(&argc, &argv);
 
+  enable_detectable_autorepeat();
+
   g_log_set_default_handler(log_handler, NULL);
 
-  while ((ch = getopt(argc, argv, "CGKTVa:nktur:c:b:p:l:f")) != -1) {
+  while ((ch = getopt(argc, argv, "CGKSTVa:nktur:c:b:p:l:fq:Q:R:F:g:A:w:")) !=
+         -1) {
     switch (ch) {
       case 'C':
         enable_keyboard_cue = 1;
@@ -1805,7 +1727,7 @@ int main(int argc, char *argv[]) {
         break;
 
       case 't':
-        time_offsets_are_zero = 1;
+        engine_config.time_offsets_are_zero = true;
         break;
 
       case 'u':
@@ -1859,8 +1781,8 @@ int main(int argc, char *argv[]) {
         break;
 
       case 'r':
-        rate_limit = strtod(optarg, NULL);
-        if (rate_limit <= 0.0) {
+        engine_config.rate_limit = strtod(optarg, NULL);
+        if (engine_config.rate_limit <= 0.0) {
           g_critical("Invalid rate limit specified.\n");
 
           exit(EX_USAGE);
@@ -1868,10 +1790,80 @@ int main(int argc, char *argv[]) {
 
         break;
 
+      case 'S':
+        engine_config.running_status = true;
+        break;
+
       case 'f':
         full_midi_keyboard = 1;
         break;
 
+      case 'q':
+        engine_config.queue_size = strtoul(optarg, NULL, 10);
+        /* One place is kept free, so a queue of one would hold nothing. */
+        if (engine_config.queue_size < 2) {
+          g_critical("Invalid output queue size specified.\n");
+
+          exit(EX_USAGE);
+        }
+
+        break;
+
+      case 'Q':
+        if (!queue_policy_from_name(optarg, &engine_config.queue_policy)) {
+          g_critical(
+              "Invalid output queue policy, proper choices are drop-newest, "
+              "drop-oldest-cc and block.");
+
+          exit(EX_USAGE);
+        }
+
+        break;
+
+      case 'R':
+        engine_config.ramp_spacing = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'F':
+        if (!engine_config.input_filter.drop(optarg)) {
+          g_critical("Invalid input filter, see the manual page.");
+
+          exit(EX_USAGE);
+        }
+
+        break;
+
+      case 'g': {
+        char *end;
+
+        engine_config.quantize = strtol(optarg, &end, 10);
+        if (*end == ',')
+          engine_config.quantize_strength = strtod(end + 1, &end);
+
+        if (engine_config.quantize < 1 || *end != '\0' ||
+            engine_config.quantize_strength < 0.0 ||
+            engine_config.quantize_strength > 1.0) {
+          g_critical("Invalid quantization specified.");
+
+          exit(EX_USAGE);
+        }
+
+        break;
+      }
+
+      case 'A':
+        if (!arp_config_from_string(optarg, &engine_config.arp)) {
+          g_critical("Invalid arpeggiator settings, see the manual page.");
+
+          exit(EX_USAGE);
+        }
+
+        break;
+
+      case 'w':
+        record_path = optarg;
+        break;
+
       case '?':
       default:
         usage();
@@ -1885,11 +1877,26 @@ int main(int argc, char *argv[]) {
    */
 
   functions_keymap->set(
-      std::string(1, GDK_equal),
+      gdk_keyval_name(GDK_equal),
       {keybind_callback_octave_up, keybind_destructor_null, NULL});
   functions_keymap->set(
-      std::string(1, GDK_minus),
+      gdk_keyval_name(GDK_minus),
       {keybind_callback_octave_down, keybind_destructor_null, NULL});
+  /*
+   * F9 records a loop, F10 overdubs, F11 plays or stops it, F12 clears it.
+   */
+  functions_keymap->set(gdk_keyval_name(GDK_F9),
+                        {keybind_callback_loop, keybind_destructor_null,
+                         (void *)(intptr_t)LOOP_RECORD, true});
+  functions_keymap->set(gdk_keyval_name(GDK_F10),
+                        {keybind_callback_loop, keybind_destructor_null,
+                         (void *)(intptr_t)LOOP_OVERDUB, true});
+  functions_keymap->set(gdk_keyval_name(GDK_F11),
+                        {keybind_callback_loop, keybind_destructor_null,
+                         (void *)(intptr_t)LOOP_PLAY, true});
+  functions_keymap->set(gdk_keyval_name(GDK_F12),
+                        {keybind_callback_loop, keybind_destructor_null,
+                         (void *)(intptr_t)LOOP_CLEAR, true});
 
   argc -= optind;
   argv += optind;
@@ -1902,7 +1909,8 @@ int main(int argc, char *argv[]) {
     int ret = piano_keyboard_set_keyboard_layout(keyboard, keyboard_layout);
 
     if (ret) {
-      g_critical("Invalid layout, proper choices are QWERTY.");
+      g_critical("Invalid layout, proper choices are %s.",
+                 key_layout_names().c_str());
       delete functions_keymap;
       exit(EX_USAGE);
     }
@@ -1931,6 +1939,13 @@ int main(int argc, char *argv[]) {
 
   gtk_main();
 
+  /* Nothing is sent once the engine is closed, so the file can be ended. */
+  engine.close();
+  if ((err = recorder.close()) != NULL) g_warning("%s", err);
+  if (recorder.lost() > 0)
+    g_warning("%zu messages were not recorded, the disk was too slow.",
+              recorder.lost());
+
   // I mean technically we could just let the memory go to waste, but
   // we did promise to call destructors in the API
   delete functions_keymap;
@@ -0,0 +1,383 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Keyboard painting.  Everything here is plain cairo on an image surface, so
+ * it runs on the render thread and never touches GTK.
+ */
+
+#include "keyboardrenderer.hh"
+
+#include <math.h>
+
+KeyboardRenderer::KeyboardRenderer(frame_ready_callback frame_ready,
+                                   void *data)
+    : frame_ready(frame_ready), data(data) {
+  worker = std::thread(&KeyboardRenderer::run, this);
+}
+
+KeyboardRenderer::~KeyboardRenderer() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_one();
+  worker.join();
+
+  if (front != NULL) cairo_surface_destroy(front);
+}
+
+void KeyboardRenderer::request(const KeyboardFrame &frame) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending = frame;
+    have_pending = true;
+  }
+  wake.notify_one();
+}
+
+bool KeyboardRenderer::blit(cairo_t *c) {
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (front == NULL) return false;
+
+  cairo_set_source_surface(c, front, 0, 0);
+  cairo_paint(c);
+
+  return true;
+}
+
+void KeyboardRenderer::run() {
+  KeyboardFrame frame;
+  cairo_surface_t *back = NULL;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this] { return have_pending || quit; });
+      if (quit) break;
+      frame = pending;
+      have_pending = false;
+    }
+
+    if (frame.width <= 0 || frame.height <= 0) continue;
+
+    if (back == NULL || cairo_image_surface_get_width(back) != frame.width ||
+        cairo_image_surface_get_height(back) != frame.height) {
+      if (back != NULL) cairo_surface_destroy(back);
+      back = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, frame.width,
+                                        frame.height);
+    }
+
+    cairo_t *c = cairo_create(back);
+    render(c, frame);
+    cairo_destroy(c);
+    cairo_surface_flush(back);
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      std::swap(front, back);
+    }
+
+    frame_ready(data);
+  }
+
+  if (back != NULL) cairo_surface_destroy(back);
+}
+
+static int is_black(int key) {
+  int note_in_octave = key % 12;
+  if (note_in_octave == 1 || note_in_octave == 3 || note_in_octave == 6 ||
+      note_in_octave == 8 || note_in_octave == 10)
+    return 1;
+  return 0;
+}
+
+static double black_key_left_shift(int key) {
+  int note_in_octave = key % 12;
+  switch (note_in_octave) {
+    case 1:
+      return 2.0 / 3.0;
+    case 3:
+      return 1.0 / 3.0;
+    case 6:
+      return 2.0 / 3.0;
+    case 8:
+      return 0.5;
+    case 10:
+      return 1.0 / 3.0;
+    default:
+      return 0;
+  }
+  return 0;
+}
+
+int layout_note_geometry(struct NoteGeometry geometry[NNOTES], int min_note,
+                         int max_note, int width, int height) {
+  int number_of_white_keys = 0, skipped_white_keys = 0, key_width,
+      black_key_width, useful_width, note, white_key, margin;
+
+  for (note = min_note; note <= max_note; ++note)
+    if (!is_black(note)) ++number_of_white_keys;
+  for (note = 0; note < min_note; ++note)
+    if (!is_black(note)) ++skipped_white_keys;
+
+  key_width = width / number_of_white_keys;
+  black_key_width = key_width * 0.8;
+  useful_width = number_of_white_keys * key_width;
+  margin = (width - useful_width) / 2;
+
+  for (note = 0, white_key = -skipped_white_keys; note < NNOTES; note++) {
+    if (is_black(note)) {
+      /* This note is black key. */
+      geometry[note].x = margin + (white_key * key_width) -
+                         (black_key_width * black_key_left_shift(note));
+      geometry[note].w = black_key_width;
+      geometry[note].h = (height * 3) / 5;
+      geometry[note].white = 0;
+      continue;
+    }
+
+    /* This note is white key. */
+    geometry[note].x = margin + white_key * key_width;
+    geometry[note].w = key_width;
+    geometry[note].h = height;
+    geometry[note].white = 1;
+
+    white_key++;
+  }
+
+  return (margin);
+}
+
+int note_at_xy(const struct NoteGeometry geometry[NNOTES], int max_note,
+               int height, int x, int y) {
+  int note;
+
+  if (y <= ((height * 2) / 3)) { /* might be a black key */
+    for (note = 0; note <= max_note; ++note) {
+      const struct NoteGeometry *g = &geometry[note];
+
+      if (g->white) continue;
+
+      if (x >= g->x && x <= g->x + g->w) return (note);
+    }
+  }
+
+  for (note = 0; note <= max_note; ++note) {
+    const struct NoteGeometry *g = &geometry[note];
+
+    if (!g->white) continue;
+
+    if (x >= g->x && x <= g->x + g->w) return (note);
+  }
+
+  return (-1);
+}
+
+static void draw_keyboard_cue(cairo_t *c, const KeyboardFrame &frame) {
+  int w, h, first_note_in_lower_row, last_note_in_lower_row,
+      first_note_in_higher_row, last_note_in_higher_row;
+  const struct NoteGeometry *g = frame.geometry;
+
+  w = g[0].w;
+  h = g[0].h;
+
+  first_note_in_lower_row = (frame.octave + 5) * 12;
+  last_note_in_lower_row = (frame.octave + 6) * 12 - 1;
+  first_note_in_higher_row = (frame.octave + 6) * 12;
+  last_note_in_higher_row = (frame.octave + 7) * 12 + 4;
+
+  if (first_note_in_lower_row < 0 || last_note_in_higher_row >= NNOTES) return;
+
+  cairo_set_source_rgb(c, 0, 0, 0);
+  cairo_set_line_width(c, 1);
+
+  cairo_move_to(c, g[first_note_in_lower_row].x + 3, h - 6 + 0.5);
+  cairo_line_to(c, g[last_note_in_lower_row].x + w - 3, h - 6 + 0.5);
+  cairo_stroke(c);
+
+  cairo_move_to(c, g[first_note_in_higher_row].x + 3, h - 9 + 0.5);
+  cairo_line_to(c, g[last_note_in_higher_row].x + w - 3, h - 9 + 0.5);
+  cairo_stroke(c);
+}
+
+void KeyboardRenderer::render(cairo_t *c, const KeyboardFrame &frame) {
+  int note;
+
+  cairo_save(c);
+  cairo_set_operator(c, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_rgba(c, 0, 0, 0, 0);
+  cairo_paint(c);
+  cairo_restore(c);
+
+  /* White keys first, black keys overlap them. */
+  for (note = frame.min_note; note <= frame.max_note; note++) {
+    const struct NoteGeometry *g = &frame.geometry[note];
+
+    if (g->white)
+      piano_keyboard_draw_white_key(c, g->x, 0, g->w, g->h,
+                                    frame.lit.test(note),
+                                    frame.velocity[note]);
+  }
+
+  for (note = frame.min_note; note <= frame.max_note; note++) {
+    const struct NoteGeometry *g = &frame.geometry[note];
+
+    if (!g->white)
+      piano_keyboard_draw_black_key(c, g->x, 0, g->w, g->h,
+                                    frame.lit.test(note),
+                                    frame.velocity[note]);
+  }
+
+  if (frame.enable_keyboard_cue) draw_keyboard_cue(c, frame);
+}
+
+void piano_keyboard_draw_white_key(cairo_t *c, int x, int y, int w, int h,
+                                   int pressed, int vel) {
+  cairo_pattern_t *pat;
+  cairo_save(c);
+  cairo_set_line_join(c, CAIRO_LINE_JOIN_MITER);
+  cairo_set_line_width(c, 1);
+
+  cairo_rectangle(c, x, y, w, h);
+  cairo_clip_preserve(c);
+
+  pat = cairo_pattern_create_linear(x, y, x, y + h);
+  cairo_pattern_add_color_stop_rgb(pat, 0.0, 0.25, 0.25, 0.2);
+  cairo_pattern_add_color_stop_rgb(pat, 0.1, 0.957, 0.914, 0.925);
+  cairo_pattern_add_color_stop_rgb(pat, 1.0, 0.796, 0.787, 0.662);
+  cairo_set_source(c, pat);
+  cairo_fill(c);
+  cairo_pattern_destroy(pat);
+
+  cairo_move_to(c, x + 0.5, y);
+  cairo_line_to(c, x + 0.5, y + h);
+  cairo_set_source_rgba(c, 1, 1, 1, 0.75);
+  cairo_stroke(c);
+
+  cairo_move_to(c, x + w - 0.5, y);
+  cairo_line_to(c, x + w - 0.5, y + h);
+  cairo_set_source_rgba(c, 0, 0, 0, 0.5);
+  cairo_stroke(c);
+
+  if (pressed) piano_keyboard_draw_pressed(c, x, y, w, h, vel);
+
+  piano_keyboard_draw_key_shadow(c, x, y, w, h);
+
+  cairo_restore(c);
+}
+
+void piano_keyboard_draw_black_key(cairo_t *c, int x, int y, int w, int h,
+                                   int pressed, int vel) {
+  cairo_pattern_t *pat;
+  cairo_save(c);
+  cairo_set_line_join(c, CAIRO_LINE_JOIN_MITER);
+  cairo_set_line_width(c, 1);
+
+  cairo_rectangle(c, x, y, w, h);
+  cairo_clip_preserve(c);
+
+  pat = cairo_pattern_create_linear(x, y, x, y + h);
+  cairo_pattern_add_color_stop_rgb(pat, 0.0, 0, 0, 0);
+  cairo_pattern_add_color_stop_rgb(pat, 0.1, 0.27, 0.27, 0.27);
+  cairo_pattern_add_color_stop_rgb(pat, 1.0, 0, 0, 0);
+  cairo_set_source(c, pat);
+  cairo_fill(c);
+  cairo_pattern_destroy(pat);
+
+  pat = cairo_pattern_create_linear(x + 1, y, x + 1, y + h - w);
+  cairo_pattern_add_color_stop_rgb(pat, 0.0, 0, 0, 0);
+  cairo_pattern_add_color_stop_rgb(pat, 0.1, 0.55, 0.55, 0.55);
+  cairo_pattern_add_color_stop_rgb(pat, 0.5, 0.45, 0.45, 0.45);
+  cairo_pattern_add_color_stop_rgb(pat, 0.5001, 0.35, 0.35, 0.35);
+  cairo_pattern_add_color_stop_rgb(pat, 1.0, 0.25, 0.25, 0.25);
+  cairo_set_source(c, pat);
+  cairo_rectangle(c, x + 1, y, w - 2, y + h - w);
+  cairo_fill(c);
+  cairo_pattern_destroy(pat);
+
+  if (pressed) piano_keyboard_draw_pressed(c, x, y, w, h, vel);
+
+  piano_keyboard_draw_key_shadow(c, x, y, w, h);
+
+  cairo_restore(c);
+}
+
+void piano_keyboard_draw_pressed(cairo_t *c, int x, int y, int w, int h,
+                                 int vel) {
+  float m = w * .15;     // margin
+  float s = w - m * 2.;  // size
+  float _vel = ((float)vel / 127.);
+  float hue = _vel * 140 + 220;  // hue 220 .. 360 - blue over pink to red
+  float sat = .5 + _vel * 0.3;   // saturation 0.5 .. 0.8
+  float val = 1. - _vel * 0.2;   // lightness 1.0 .. 0.8
+  cairo_rectangle(c, x + m, y + h - m - s * 2, s, s * 2);
+  hsv HSV = {hue, sat, val};
+  rgb RGB = hsv2rgb(HSV);
+  cairo_set_source_rgb(c, RGB.r, RGB.g, RGB.b);
+  cairo_fill(c);
+}
+
+void piano_keyboard_draw_key_shadow(cairo_t *c, int x, int y, int w, int h) {
+  cairo_pattern_t *pat;
+  pat = cairo_pattern_create_linear(x, y, x, y + (int)(h * 0.2));
+  cairo_pattern_add_color_stop_rgba(pat, 0.0, 0, 0, 0, 0.4);
+  cairo_pattern_add_color_stop_rgba(pat, 1.0, 0, 0, 0, 0);
+  cairo_rectangle(c, x, y, w, (int)(h * 0.2));
+  cairo_set_source(c, pat);
+  cairo_fill(c);
+  cairo_pattern_destroy(pat);
+}
+
+rgb hsv2rgb(hsv HSV) {
+  rgb RGB;
+  double H = HSV.h, S = HSV.s, V = HSV.v, P, Q, T, fract;
+
+  (H == 360.) ? (H = 0.) : (H /= 60.);
+  fract = H - floor(H);
+
+  P = V * (1. - S);
+  Q = V * (1. - S * fract);
+  T = V * (1. - S * (1. - fract));
+
+  if (0. <= H && H < 1.)
+    RGB = (rgb){.r = V, .g = T, .b = P};
+  else if (1. <= H && H < 2.)
+    RGB = (rgb){.r = Q, .g = V, .b = P};
+  else if (2. <= H && H < 3.)
+    RGB = (rgb){.r = P, .g = V, .b = T};
+  else if (3. <= H && H < 4.)
+    RGB = (rgb){.r = P, .g = Q, .b = V};
+  else if (4. <= H && H < 5.)
+    RGB = (rgb){.r = T, .g = P, .b = V};
+  else if (5. <= H && H < 6.)
+    RGB = (rgb){.r = V, .g = P, .b = Q};
+  else
+    RGB = (rgb){.r = 0., .g = 0., .b = 0.};
+
+  return RGB;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cairo.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "notestate.hh"
+
+struct NoteGeometry {
+  int x;     /* Distance between the left edge of the key
+              * and the left edge of the widget, in pixels. */
+  int w;     /* Width of the key, in pixels. */
+  int h;     /* Height of the key, in pixels. */
+  int white; /* 1 if key is white; 0 otherwise. */
+};
+
+/**
+ * Lays out the keys from min_note to max_note over a widget of the given
+ * size, filling in the geometry of every note.  Returns the margin left on
+ * either side.
+ */
+int layout_note_geometry(struct NoteGeometry geometry[NNOTES], int min_note,
+                         int max_note, int width, int height);
+
+// the note under x, y, black keys first; -1 if there is none
+int note_at_xy(const struct NoteGeometry geometry[NNOTES], int max_note,
+               int height, int x, int y);
+
+/**
+ * Everything needed to paint the keyboard, copied out of the widget so the
+ * render thread never looks at the widget itself.
+ */
+struct KeyboardFrame {
+  int width;
+  int height;
+  int min_note;
+  int max_note;
+  NoteSet lit; /* Pressed or sustained. */
+  unsigned char velocity[NNOTES];
+  struct NoteGeometry geometry[NNOTES];
+  int enable_keyboard_cue;
+  int octave;
+};
+
+/**
+ * Paints the keyboard on a worker thread, into an image surface.
+ *
+ * The GTK thread hands over a frame with request(), which only copies it
+ * under a short lock; the worker always renders the latest frame it has been
+ * given, so bursts of requests collapse into one paint.  When a frame is done
+ * the frame_ready callback is called from the worker thread, and the GTK
+ * thread then copies it to the window with blit().
+ */
+class KeyboardRenderer {
+ public:
+  typedef void (*frame_ready_callback)(void *data);
+
+  KeyboardRenderer(frame_ready_callback frame_ready, void *data);
+
+  ~KeyboardRenderer();
+
+  void request(const KeyboardFrame &frame);
+
+  // paints the last finished frame at 0, 0; false if there is none yet
+  bool blit(cairo_t *c);
+
+  // paints frame into c synchronously, on the calling thread
+  static void render(cairo_t *c, const KeyboardFrame &frame);
+
+ private:
+  void run();
+
+  frame_ready_callback frame_ready;
+  void *data;
+
+  std::mutex lock;
+  std::condition_variable wake;
+  KeyboardFrame pending;
+  bool have_pending = false;
+  bool quit = false;
+  // last finished frame, protected by lock
+  cairo_surface_t *front = NULL;
+
+  std::thread worker;
+};
+
+typedef struct {
+  double r;
+  double g;
+  double b;
+} rgb;
+
+typedef struct {
+  double h;
+  double s;
+  double v;
+} hsv;
+
+void piano_keyboard_draw_white_key(cairo_t *c, int x, int y, int w, int h,
+                                   int pressed, int val);
+void piano_keyboard_draw_black_key(cairo_t *c, int x, int y, int w, int h,
+                                   int pressed, int val);
+void piano_keyboard_draw_pressed(cairo_t *c, int x, int y, int w, int h,
+                                 int val);
+void piano_keyboard_draw_key_shadow(cairo_t *c, int x, int y, int w, int h);
+rgb hsv2rgb(hsv HSV);
@@ -0,0 +1,296 @@
+#include "keylayout.hh"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <iostream>
+
+// generated from the shipped layout files
+#include "defaultlayout.hh"
+
+// where the installed layouts.pack is, set by CMake
+#ifndef LAYOUT_PACK_DIR
+#define LAYOUT_PACK_DIR "/usr/local/share/jack-keyboard"
+#endif
+
+// more rows in a pack directory are ignored
+#define MAX_PACK_LAYOUTS 64
+
+static constexpr KeyLayout default_layout = decode_key_layout(
+    std::span(default_board_csv), std::span(default_bindings_csv));
+
+static_assert(default_layout.board && !default_layout.board.invalid &&
+                  default_layout.bindings && !default_layout.bindings.invalid,
+              "boards/qwerty.csv or bindings/keymap.csv is not valid");
+
+static constexpr std::span<const LayoutKey> default_keys{default_layout.keys,
+                                                         default_layout.nkeys};
+
+constinit const KeyBindingTable default_key_bindings =
+    board_key_bindings(default_keys);
+
+// every layout loaded, so they can be resolved again
+static std::vector<LoadedLayout *> loaded_layouts;
+static key_name_resolver resolver = NULL;
+static void *resolver_data = NULL;
+
+LoadedLayout::LoadedLayout(std::span<const LayoutKey> keys,
+                           std::optional<MappedFile> text)
+    : keys(keys.begin(), keys.end()), text(std::move(text)) {
+  resolve();
+  loaded_layouts.push_back(this);
+}
+
+LoadedLayout::~LoadedLayout() { std::erase(loaded_layouts, this); }
+
+void LoadedLayout::resolve() {
+  KeyBindingTable resolved{};
+
+  for (const LayoutKey &key : keys) {
+    int code = resolver ? resolver(key.name, resolver_data) : -1;
+
+    if (code < 0) code = key.board_code;
+    if (code >= 0 && code < NKEYCODES) resolved.note[code] = key.note;
+  }
+
+  table = resolved;
+}
+
+void set_key_name_resolver(key_name_resolver new_resolver, void *data) {
+  resolver = new_resolver;
+  resolver_data = data;
+  key_names_changed();
+}
+
+void key_names_changed() {
+  for (LoadedLayout *layout : loaded_layouts) layout->resolve();
+}
+
+// a row of a pack's directory
+struct PackDirectoryEntry {
+  std::string_view name;
+  int board_offset;
+  int board_length;
+  int bindings_offset;
+  int bindings_length;
+};
+
+static constexpr CSVColumn<PackDirectoryEntry> directory_columns[] = {
+    {"layout", csv_field<&PackDirectoryEntry::name, decode_string>},
+    {"board_offset", csv_field<&PackDirectoryEntry::board_offset, decode_int>},
+    {"board_length", csv_field<&PackDirectoryEntry::board_length, decode_int>},
+    {"bindings_offset",
+     csv_field<&PackDirectoryEntry::bindings_offset, decode_int>},
+    {"bindings_length",
+     csv_field<&PackDirectoryEntry::bindings_length, decode_int>},
+};
+
+static bool report_csv(const std::string &filename,
+                       const CSVDecodeResult &result) {
+  if (!result) {
+    std::cerr << filename << ": no \"" << result.missing << "\" column\n";
+    return false;
+  }
+  if (result.invalid)
+    std::cerr << filename << ": skipped " << result.invalid
+              << " invalid rows, the first is row " << result.first_invalid
+              << "\n";
+  if (result.dropped)
+    std::cerr << filename << ": ignored " << result.dropped
+              << " rows past the first " << result.rows << "\n";
+  return true;
+}
+
+static std::optional<MappedFile> open_layout_file(
+    const std::filesystem::path &path) {
+  auto file{MappedFile::open(path)};
+  // not having one is fine, there are other places to look
+  if (!file && errno != ENOENT)
+    std::cout << "Failed to open " << path.string() << ": " << strerror(errno)
+              << "\n";
+  return file;
+}
+
+static bool same_name(std::string_view a, std::string_view b) {
+  return a.length() == b.length() &&
+         strncasecmp(a.data(), b.data(), a.length()) == 0;
+}
+
+// the section at offset, length of sections; empty if out of range
+static std::span<char> pack_section(std::span<char> sections, int offset,
+                                    int length) {
+  if (offset < 0 || length <= 0 || (size_t)offset > sections.size() ||
+      (size_t)length > sections.size() - offset)
+    return {};
+  return sections.subspan(offset, length);
+}
+
+std::optional<LayoutPack> LayoutPack::open(const std::filesystem::path &path) {
+  auto file{open_layout_file(path)};
+  if (!file) return std::nullopt;
+
+  std::span<char> text = file->data();
+  size_t separator =
+      std::string_view(text.data(), text.size()).find("\n%%\n");
+  if (separator == std::string_view::npos) {
+    std::cerr << path.string() << ": not a layout pack\n";
+    return std::nullopt;
+  }
+
+  std::span<char> directory = text.first(separator + 1);
+  std::span<char> sections = text.subspan(separator + 4);
+
+  PackDirectoryEntry rows[MAX_PACK_LAYOUTS];
+  auto result{decode_csv<PackDirectoryEntry>(directory, directory_columns,
+                                             rows)};
+  if (!report_csv(path.string(), result)) return std::nullopt;
+
+  // the mapping does not move with the MappedFile, so the views stay valid
+  LayoutPack pack{path, std::move(file.value())};
+
+  for (const PackDirectoryEntry &row : std::span(rows, result.rows)) {
+    std::span<char> board =
+        pack_section(sections, row.board_offset, row.board_length);
+    std::span<char> bindings =
+        pack_section(sections, row.bindings_offset, row.bindings_length);
+
+    if (board.empty() || bindings.empty()) {
+      std::cerr << path.string() << ": layout " << row.name
+                << " is outside of the pack\n";
+      continue;
+    }
+
+    pack.entries.push_back({row.name, board, bindings, nullptr, false});
+  }
+
+  return pack;
+}
+
+const KeyBindingTable *LayoutPack::find(std::string_view name) {
+  for (Entry &entry : entries) {
+    if (!same_name(entry.name, name)) continue;
+
+    if (!entry.layout && !entry.invalid) {
+      // sections are only decoded once, as decoding unescapes them in place
+      KeyLayout layout{decode_key_layout(entry.board, entry.bindings)};
+      std::string label = path.string() + " " + std::string(entry.name);
+      bool board_ok = report_csv(label + " board", layout.board);
+      bool bindings_ok = report_csv(label + " bindings", layout.bindings);
+
+      if (board_ok && bindings_ok)
+        entry.layout = std::make_unique<LoadedLayout>(
+            std::span<const LayoutKey>(layout.keys, layout.nkeys));
+      else
+        entry.invalid = true;
+    }
+
+    return entry.layout ? &entry.layout->bindings() : NULL;
+  }
+
+  return NULL;
+}
+
+// everything find_key_layout() loads, kept for the life of the program
+static bool user_pack_opened = false;
+static bool installed_pack_opened = false;
+// the user's pack first
+static std::vector<LayoutPack> packs;
+static bool user_qwerty_loaded = false;
+static std::unique_ptr<LoadedLayout> user_qwerty;
+static std::unique_ptr<LoadedLayout> builtin_qwerty;
+
+static std::optional<std::filesystem::path> home_path(const char *relative) {
+  const char *homedir = getenv("HOME");
+  if (homedir == NULL) return std::nullopt;
+
+  return std::filesystem::path(homedir) / ".jack-keyboard" / relative;
+}
+
+static void open_packs(bool installed) {
+  if (!user_pack_opened) {
+    user_pack_opened = true;
+
+    if (auto user_pack{home_path("layouts.pack")}; user_pack)
+      if (auto pack{LayoutPack::open(user_pack.value())}; pack)
+        packs.push_back(std::move(pack.value()));
+  }
+
+  if (installed && !installed_pack_opened) {
+    installed_pack_opened = true;
+
+    if (auto pack{LayoutPack::open(LAYOUT_PACK_DIR "/layouts.pack")}; pack)
+      packs.push_back(std::move(pack.value()));
+  }
+}
+
+/*
+ * The QWERTY board and bindings files in ~/.jack-keyboard, as they were used
+ * before there were layout packs.
+ */
+static const LoadedLayout *load_user_qwerty() {
+  if (user_qwerty_loaded) return user_qwerty.get();
+  user_qwerty_loaded = true;
+
+  auto board_path{home_path("boards/qwerty.csv")};
+  auto bindings_path{home_path("bindings/keymap.csv")};
+  if (!board_path || !bindings_path) return NULL;
+
+  auto board{open_layout_file(board_path.value())};
+  if (!board) return NULL;
+
+  auto bindings{open_layout_file(bindings_path.value())};
+  if (!bindings) return NULL;
+
+  KeyLayout layout{decode_key_layout(board->data(), bindings->data())};
+  bool board_ok = report_csv(board_path->string(), layout.board);
+  bool bindings_ok = report_csv(bindings_path->string(), layout.bindings);
+  if (!board_ok || !bindings_ok) return NULL;
+
+  // the key names point into the bindings file, so it stays mapped
+  user_qwerty = std::make_unique<LoadedLayout>(
+      std::span<const LayoutKey>(layout.keys, layout.nkeys),
+      std::move(bindings));
+  return user_qwerty.get();
+}
+
+const KeyBindingTable *find_key_layout(std::string_view name) {
+  bool qwerty = same_name(name, "QWERTY");
+
+  if (qwerty)
+    if (const LoadedLayout *layout = load_user_qwerty())
+      return &layout->bindings();
+
+  // the installed pack's QWERTY is built from the same files as ours
+  open_packs(!qwerty);
+  for (LayoutPack &pack : packs)
+    if (const KeyBindingTable *table = pack.find(name)) return table;
+
+  if (!qwerty) return NULL;
+
+  // no parsing, the keys were decoded at build time
+  if (!builtin_qwerty)
+    builtin_qwerty = std::make_unique<LoadedLayout>(default_keys);
+  return &builtin_qwerty->bindings();
+}
+
+std::string key_layout_names() {
+  std::vector<std::string_view> names{"QWERTY"};
+
+  open_packs(true);
+  for (const LayoutPack &pack : packs) {
+    pack.for_each_name([&names](std::string_view name) {
+      for (std::string_view known : names)
+        if (same_name(known, name)) return;
+      names.push_back(name);
+    });
+  }
+
+  std::string joined;
+  for (std::string_view name : names) {
+    if (!joined.empty()) joined += ", ";
+    joined += name;
+  }
+  return joined;
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "easycsv.hh"
+
+/* X keycodes fit in a byte. */
+#define NKEYCODES 256
+
+// a row of a board file, naming a key code
+struct BoardKey {
+  int code;
+  std::string_view name;
+};
+
+inline constexpr CSVColumn<BoardKey> board_columns[] = {
+    {"code", csv_field<&BoardKey::code, decode_int>},
+    {"name", csv_field<&BoardKey::name, decode_string>},
+};
+
+// a row of a bindings file, binding a named key to a note
+struct KeyNote {
+  std::string_view key;
+  int note;
+};
+
+inline constexpr CSVColumn<KeyNote> binding_columns[] = {
+    {"key", csv_field<&KeyNote::key, decode_string>},
+    {"note", csv_field<&KeyNote::note, decode_note>},
+};
+
+/**
+ * The MIDI note every key code plays, 0 if the key is not bound.
+ */
+struct KeyBindingTable {
+  unsigned char note[NKEYCODES];
+
+  constexpr int lookup(unsigned key) const {
+    return key < NKEYCODES ? note[key] : 0;
+  }
+};
+
+// a key of a layout: the note it plays, by name and by the board's key code
+struct LayoutKey {
+  std::string_view name;
+  int note;
+  // -1 if the board does not name this key
+  int board_code;
+};
+
+// a layout's keys, and how decoding the files they came from went
+struct KeyLayout {
+  LayoutKey keys[NKEYCODES];
+  size_t nkeys;
+  CSVDecodeResult board;
+  CSVDecodeResult bindings;
+};
+
+/**
+ * Decodes a board file, which names key codes, and a bindings file, which
+ * binds key names to notes.  The names point into bindings.  Works at compile
+ * time as well, on read-only text.
+ */
+template <typename CharT>
+constexpr KeyLayout decode_key_layout(std::span<CharT> board,
+                                      std::span<CharT> bindings) {
+  KeyLayout layout{};
+  BoardKey board_keys[NKEYCODES]{};
+  KeyNote notes[NKEYCODES]{};
+
+  layout.board = decode_csv<BoardKey>(board, board_columns, board_keys);
+  layout.bindings = decode_csv<KeyNote>(bindings, binding_columns, notes);
+  if (!layout.board || !layout.bindings) return layout;
+
+  // the board is small, a linear search per binding is plenty
+  for (const KeyNote& n : std::span(notes, layout.bindings.rows)) {
+    LayoutKey& key = layout.keys[layout.nkeys++];
+
+    key = {n.key, n.note, -1};
+    for (const BoardKey& k : std::span(board_keys, layout.board.rows)) {
+      if (k.name == n.key) {
+        if (k.code >= 0 && k.code < NKEYCODES) key.board_code = k.code;
+        break;
+      }
+    }
+  }
+
+  return layout;
+}
+
+// binds every key to the key code its board gives it
+constexpr KeyBindingTable board_key_bindings(std::span<const LayoutKey> keys) {
+  KeyBindingTable table{};
+
+  for (const LayoutKey& key : keys)
+    if (key.board_code >= 0) table.note[key.board_code] = key.note;
+
+  return table;
+}
+
+// boards/qwerty.csv and bindings/keymap.csv, decoded at build time
+extern const KeyBindingTable default_key_bindings;
+
+/**
+ * Maps a key name from a bindings file to the key code that types it on the
+ * keyboard at hand, or -1 if none does.
+ */
+typedef int (*key_name_resolver)(std::string_view name, void* data);
+
+/**
+ * A layout in use.  Its table is what the keyboard looks key codes up in; it
+ * is resolved when the layout is loaded, and again in place whenever the
+ * resolver or the keymap behind it changes, so holders of the table always
+ * see the current one.
+ */
+class LoadedLayout {
+ public:
+  // text is kept alive for the key names pointing into it
+  LoadedLayout(std::span<const LayoutKey> keys,
+               std::optional<MappedFile> text = std::nullopt);
+
+  LoadedLayout(const LoadedLayout&) = delete;
+
+  LoadedLayout& operator=(const LoadedLayout&) = delete;
+
+  ~LoadedLayout();
+
+  const KeyBindingTable& bindings() const { return table; }
+
+  // binds by resolver, falling back to the board for names it doesn't know
+  void resolve();
+
+ private:
+  std::vector<LayoutKey> keys;
+  std::optional<MappedFile> text;
+  KeyBindingTable table;
+};
+
+/**
+ * Resolves key names with resolver from now on, rather than only with board
+ * files, and re-resolves every loaded layout.  NULL goes back to board files.
+ * Like everything loading layouts, GTK thread only.
+ */
+void set_key_name_resolver(key_name_resolver resolver, void* data);
+
+// what the resolver returns changed, e.g. the keymap did
+void key_names_changed();
+
+/**
+ * A layout pack, many layouts in one file as built by cmake/LayoutPack.cmake:
+ * a CSV directory with a row per layout, then a "%%" line, then the board and
+ * bindings sections the directory points at.
+ *
+ * Only the directory is read when the pack is opened.  A layout's sections
+ * are decoded the first time it is asked for, in place in the private
+ * mapping, and the layout is kept, so asking again is just a lookup.
+ */
+class LayoutPack {
+ public:
+  // on failure prints why and returns std::nullopt
+  static std::optional<LayoutPack> open(const std::filesystem::path& path);
+
+  LayoutPack(LayoutPack&&) = default;
+
+  // NULL if there is no such layout, or it does not decode
+  const KeyBindingTable* find(std::string_view name);
+
+  template <typename F>
+  void for_each_name(F&& f) const {
+    for (const Entry& entry : entries) f(entry.name);
+  }
+
+ private:
+  struct Entry {
+    std::string_view name;
+    std::span<char> board;
+    std::span<char> bindings;
+    std::unique_ptr<LoadedLayout> layout;
+    // decoding was tried and failed, don't try again
+    bool invalid = false;
+  };
+
+  LayoutPack(std::filesystem::path path, MappedFile file)
+      : path(std::move(path)), file(std::move(file)) {}
+
+  std::filesystem::path path;
+  MappedFile file;
+  std::vector<Entry> entries;
+};
+
+/**
+ * Finds a layout by name, ignoring case: ~/.jack-keyboard/layouts.pack, then
+ * the installed layouts.pack.  QWERTY comes from the board and bindings files
+ * in ~/.jack-keyboard, then ~/.jack-keyboard/layouts.pack, then the built in
+ * copy of the shipped files; the installed pack holds the same, so it is
+ * never opened for the default layout.
+ *
+ * Layouts are loaded once and live as long as the program, so switching
+ * layouts is just swapping a pointer.  GTK thread only.  NULL if no such
+ * layout is found.
+ */
+const KeyBindingTable* find_key_layout(std::string_view name);
+
+// the names find_key_layout() knows, separated by ", "
+std::string key_layout_names();
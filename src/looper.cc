@@ -0,0 +1,101 @@
+#include "looper.hh"
+
+#include <math.h>
+#include <string.h>
+
+#include "midi.hh"
+
+void Looper::set_state(LoopState new_state) {
+  current = new_state;
+  published.store(new_state, std::memory_order_relaxed);
+}
+
+/* Makes what was recorded a loop, going on from where the recording is.
+ * The recording started into its first bar, so the loop starts at that
+ * bar's line. */
+void Looper::finish_recording(double frames_per_bar) {
+  uint32_t recorded_length = position;
+
+  length = recorded_length;
+  if (frames_per_bar > 0.0)
+    length = std::max(lround(recorded_length / frames_per_bar), 1L) *
+             frames_per_bar;
+  length = std::max<uint32_t>(length, 1);
+
+  /* Cut what falls past a shortened end. */
+  while (count > 0 && events[count - 1].offset >= length) count--;
+
+  end_held_notes(std::min(recorded_length, length) - 1);
+
+  seek(recorded_length % length);
+}
+
+/* Ends the notes recorded on and not off at offset. */
+void Looper::end_held_notes(uint32_t offset) {
+  for (int channel = 0; channel < CHANNELS; channel++) {
+    recorded[channel].for_each([&](int note) {
+      unsigned char off[3] = {(unsigned char)(MIDI_NOTE_OFF | channel),
+                              (unsigned char)note, 0};
+      insert(offset, off, 3);
+    });
+    recorded[channel].clear();
+  }
+}
+
+/* Goes on playing from offset. */
+void Looper::seek(uint32_t offset) {
+  position = offset;
+  next = std::lower_bound(events, events + count, offset,
+                          [](const Event &event, uint32_t offset) {
+                            return (event.offset < offset);
+                          }) -
+         events;
+}
+
+bool Looper::insert(uint32_t offset, const unsigned char *data, int len) {
+  int status = data[0] & 0xF0, i = count;
+  bool note_off = len == 3 && (status == MIDI_NOTE_OFF ||
+                               (status == MIDI_NOTE_ON && data[2] == 0));
+
+  /* The last NNOTES places are kept for note offs, so notes can end. */
+  if (count == CAPACITY || (count >= CAPACITY - NNOTES && !note_off))
+    return (false);
+
+  /* Recording appends; only overdubs move anything. */
+  for (; i > 0 && events[i - 1].offset > offset; i--)
+    events[i] = events[i - 1];
+
+  events[i].offset = offset;
+  events[i].len = len;
+  memcpy(events[i].data, data, len);
+  count++;
+
+  /* Behind where this cycle's playing got to, and not to play again. */
+  if (current == LOOP_OVERDUBBING && offset < position) next++;
+
+  return (true);
+}
+
+void Looper::record(jack_nframes_t t, const unsigned char *data, int len) {
+  int status = data[0] & 0xF0, channel = data[0] & 0x0F, note = data[1];
+  uint32_t offset = cycle_position + t;
+  bool on, off;
+
+  if (current != LOOP_RECORDING && current != LOOP_OVERDUBBING) return;
+
+  /* Channel messages only; the rest has no place in a loop. */
+  if (data[0] < 0x80 || data[0] >= 0xF0) return;
+
+  if (current == LOOP_OVERDUBBING) offset %= length;
+
+  on = len == 3 && status == MIDI_NOTE_ON && data[2] != 0;
+  off = len == 3 && (status == MIDI_NOTE_OFF || status == MIDI_NOTE_ON) && !on;
+
+  /* The note began before the recording did. */
+  if (off && !recorded[channel].test(note)) return;
+
+  if (!insert(offset, data, len)) return;
+
+  if (on) recorded[channel].set(note);
+  if (off) recorded[channel].reset(note);
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <jack/jack.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "midi.hh"
+#include "notestate.hh"
+
+enum LoopAction {
+  // starts recording a new loop, or ends the recording and plays it
+  LOOP_RECORD = 1,
+  // records over the loop while it plays, or stops doing so
+  LOOP_OVERDUB = 2,
+  // plays the loop from its start, or stops it
+  LOOP_PLAY = 4,
+  LOOP_CLEAR = 8,
+};
+
+enum LoopState {
+  LOOP_EMPTY,
+  LOOP_RECORDING,
+  LOOP_PLAYING,
+  LOOP_OVERDUBBING,
+  LOOP_STOPPED,
+};
+
+/**
+ * Records what is played and plays it back over and over, in the JACK
+ * thread.  Events live in a fixed array sorted by their place in the loop,
+ * so recording, overdubbing and playing never allocate, and a cycle costs
+ * the events it plays plus, for each one recorded while overdubbing, moving
+ * the ones after it.
+ *
+ * Other threads only ask for actions, with request(), which the next
+ * cycle() carries out, and read state().
+ *
+ * Notes never hang: notes held when a recording or an overdub ends get their
+ * note off at that point, a note the loop plays again while it still sounds
+ * is ended first, and stopping or clearing the loop ends whatever it plays.
+ */
+class Looper {
+ public:
+  static constexpr int CAPACITY = 8192;
+  static constexpr int CHANNELS = 16;
+
+  // any thread
+  void request(LoopAction action) {
+    requests.fetch_or(action, std::memory_order_release);
+  }
+
+  LoopState state() const {
+    return published.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * JACK thread, once per cycle before record(): carries out the actions
+   * asked for and calls emit(t, data, len) for every message the loop plays
+   * in this cycle of nframes, t being the frame of the cycle, in time order.
+   * While frames_per_bar is not 0, bar_position frames into the bar at the
+   * start of the cycle, a loop starts at a bar line and is made a whole
+   * number of bars long, and plays in step with the bars.
+   */
+  template <typename Emit>
+  void cycle(jack_nframes_t nframes, double frames_per_bar,
+             double bar_position, Emit &&emit);
+
+  // JACK thread: a message sent at frame t of the cycle
+  void record(jack_nframes_t t, const unsigned char *data, int len);
+
+ private:
+  struct Event {
+    uint32_t offset;
+    uint8_t len;
+    unsigned char data[3];
+  };
+
+  void set_state(LoopState new_state);
+
+  void finish_recording(double frames_per_bar);
+
+  void end_held_notes(uint32_t offset);
+
+  void seek(uint32_t offset);
+
+  bool insert(uint32_t offset, const unsigned char *data, int len);
+
+  template <typename Emit>
+  void stop(Emit &&emit);
+
+  template <typename Emit>
+  void play(const Event &event, jack_nframes_t t, Emit &&emit);
+
+  std::atomic<unsigned int> requests{0};
+  std::atomic<LoopState> published{LOOP_EMPTY};
+
+  // JACK thread only from here on
+  LoopState current = LOOP_EMPTY;
+  Event events[CAPACITY];
+  int count = 0;
+  // frames long, 0 while the first recording runs
+  uint32_t length = 0;
+  // where the cycle being run started, and where the next one starts; a
+  // recording starts as far into the loop as the cycle is into its bar
+  uint32_t cycle_position = 0;
+  uint32_t position = 0;
+  // the first event not played yet in this pass
+  int next = 0;
+  // notes recorded on and not off yet, and notes the loop has sounding
+  NoteSet recorded[CHANNELS] = {};
+  NoteSet sounding[CHANNELS] = {};
+};
+
+template <typename Emit>
+void Looper::stop(Emit &&emit) {
+  for (int channel = 0; channel < CHANNELS; channel++) {
+    sounding[channel].for_each([&](int note) {
+      unsigned char off[3] = {(unsigned char)(MIDI_NOTE_OFF | channel),
+                              (unsigned char)note, 0};
+      emit(0, off, 3);
+    });
+    sounding[channel].clear();
+  }
+}
+
+template <typename Emit>
+void Looper::play(const Event &event, jack_nframes_t t, Emit &&emit) {
+  int status = event.data[0] & 0xF0, channel = event.data[0] & 0x0F;
+  int note = event.data[1];
+
+  if (event.len == 3 && status == MIDI_NOTE_ON && event.data[2] != 0) {
+    if (sounding[channel].test(note)) {
+      unsigned char off[3] = {(unsigned char)(MIDI_NOTE_OFF | channel),
+                              (unsigned char)note, 0};
+      emit(t, off, 3);
+    }
+    sounding[channel].set(note);
+  } else if (event.len == 3 &&
+             (status == MIDI_NOTE_OFF || status == MIDI_NOTE_ON)) {
+    /* Only end what the loop started. */
+    if (!sounding[channel].test(note)) return;
+    sounding[channel].reset(note);
+  }
+
+  emit(t, event.data, event.len);
+}
+
+template <typename Emit>
+void Looper::cycle(jack_nframes_t nframes, double frames_per_bar,
+                   double bar_position, Emit &&emit) {
+  unsigned int actions = requests.exchange(0, std::memory_order_acquire);
+  uint32_t into_bar = frames_per_bar > 0.0 ? lround(bar_position) : 0;
+  jack_nframes_t t = 0;
+
+  if (actions & LOOP_CLEAR) {
+    stop(emit);
+    count = 0;
+    length = 0;
+    set_state(LOOP_EMPTY);
+  }
+
+  if (actions & LOOP_RECORD) {
+    if (current == LOOP_RECORDING) {
+      finish_recording(frames_per_bar);
+      set_state(LOOP_PLAYING);
+    } else {
+      stop(emit);
+      count = 0;
+      length = 0;
+      position = into_bar;
+      for (NoteSet &notes : recorded) notes.clear();
+      set_state(LOOP_RECORDING);
+    }
+  }
+
+  if (actions & LOOP_OVERDUB) {
+    if (current == LOOP_RECORDING) finish_recording(frames_per_bar);
+
+    if (current == LOOP_OVERDUBBING) {
+      end_held_notes(position);
+      set_state(LOOP_PLAYING);
+    } else if (current != LOOP_EMPTY) {
+      for (NoteSet &notes : recorded) notes.clear();
+      set_state(LOOP_OVERDUBBING);
+    }
+  }
+
+  if (actions & LOOP_PLAY) {
+    if (current == LOOP_RECORDING) {
+      finish_recording(frames_per_bar);
+      set_state(LOOP_PLAYING);
+    } else if (current == LOOP_PLAYING || current == LOOP_OVERDUBBING) {
+      if (current == LOOP_OVERDUBBING) end_held_notes(position);
+      stop(emit);
+      set_state(LOOP_STOPPED);
+    } else if (current == LOOP_STOPPED) {
+      seek(into_bar % length);
+      set_state(LOOP_PLAYING);
+    }
+  }
+
+  cycle_position = position;
+
+  if (current == LOOP_RECORDING) {
+    position += nframes;
+    return;
+  }
+
+  if (current != LOOP_PLAYING && current != LOOP_OVERDUBBING) return;
+
+  /* Up to the end of the loop, then from its start again. */
+  while (t < nframes) {
+    jack_nframes_t span = std::min<jack_nframes_t>(nframes - t,
+                                                   length - position);
+
+    for (; next < count && events[next].offset < position + span; next++)
+      play(events[next], t + events[next].offset - position, emit);
+
+    position += span;
+    t += span;
+
+    if (position >= length) {
+      position = 0;
+      next = 0;
+    }
+  }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/* MIDI status bytes and controller numbers used throughout jack-keyboard. */
+
+#define MIDI_NOTE_ON 0x90
+#define MIDI_NOTE_OFF 0x80
+#define MIDI_PROGRAM_CHANGE 0xC0
+#define MIDI_CONTROLLER 0xB0
+#define MIDI_PITCH 0xE0
+#define MIDI_SONG_POSITION 0xF2
+#define MIDI_CLOCK 0xF8
+#define MIDI_START 0xFA
+#define MIDI_CONTINUE 0xFB
+#define MIDI_STOP 0xFC
+#define MIDI_ACTIVE_SENSING 0xFE
+#define MIDI_RESET 0xFF
+#define MIDI_HOLD_PEDAL 64
+#define MIDI_ALL_SOUND_OFF 120
+#define MIDI_ALL_MIDI_CONTROLLERS_OFF 121
+#define MIDI_ALL_NOTES_OFF 123
+#define MIDI_BANK_SELECT_MSB 0
+#define MIDI_BANK_SELECT_LSB 32
+#define MIDI_MOD_CC 1
@@ -0,0 +1,944 @@
+/*-
+ * Copyright (c) 2007, 2008 Edward Tomasz Napierała <trasz@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "midiengine.hh"
+
+#include <assert.h>
+#include <jack/midiport.h>
+#include <jack/transport.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sysexits.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <utility>
+
+#include "midi.hh"
+
+#define OUTPUT_PORT_NAME "midi_out"
+#define INPUT_PORT_NAME "midi_in"
+
+/* Will emit a warning if time between jack callbacks is longer than this. */
+#define MAX_TIME_BETWEEN_CALLBACKS 0.1
+
+/* Will emit a warning if execution of jack callback takes longer than this. */
+#define MAX_PROCESSING_TIME 0.01
+
+#ifdef MEASURE_TIME
+
+static double get_time(void) {
+  double seconds;
+  int ret;
+  struct timeval tv;
+
+  ret = gettimeofday(&tv, NULL);
+
+  if (ret) {
+    perror("gettimeofday");
+    exit(EX_OSERR);
+  }
+
+  seconds = tv.tv_sec + tv.tv_usec / 1000000.0;
+
+  return (seconds);
+}
+
+static double get_delta_time(void) {
+  static double previously = -1.0;
+  double now;
+  double delta;
+
+  now = get_time();
+
+  if (previously == -1.0) {
+    previously = now;
+
+    return (0);
+  }
+
+  delta = now - previously;
+  previously = now;
+
+  assert(delta >= 0.0);
+
+  return (delta);
+}
+
+#endif /* MEASURE_TIME */
+
+const char *MidiEngine::open(const MidiEngineConfig &new_config) {
+  int err;
+
+  assert(jack_client == NULL);
+
+  config = new_config;
+  arpeggiator.configure(config.arp);
+  std::fill_n(&sent[0][0], ControllerSlots::CHANNELS * ControllerSlots::SLOTS,
+              -1);
+
+  jack_client = jack_client_open(config.client_name, JackNoStartServer, NULL);
+
+  if (jack_client == NULL)
+    return ("Could not connect to the JACK server; run jackd first?");
+
+  /* Rounded up to a power of two; the byte a ringbuffer keeps free costs
+   * the last message. */
+  ringbuffer = jack_ringbuffer_create(config.queue_size * sizeof(MidiMessage));
+
+  if (ringbuffer == NULL) return ("Cannot create JACK ringbuffer.");
+
+  jack_ringbuffer_mlock(ringbuffer);
+
+  err = jack_set_process_callback(jack_client, process_callback, this);
+  if (err) return ("Could not register JACK process callback.");
+
+  err = jack_set_graph_order_callback(jack_client, graph_order_callback, this);
+  if (err) return ("Could not register JACK graph order callback.");
+
+  output = jack_port_register(jack_client, OUTPUT_PORT_NAME,
+                              JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+
+  if (output == NULL) return ("Could not register JACK output port.");
+
+  input = jack_port_register(jack_client, INPUT_PORT_NAME,
+                             JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+
+  if (input == NULL) return ("Could not register JACK input port.");
+
+  return (NULL);
+}
+
+const char *MidiEngine::activate() {
+  if (jack_activate(jack_client)) return ("Cannot activate JACK client.");
+
+  return (NULL);
+}
+
+void MidiEngine::close() {
+  /* Stops the process callback before the ringbuffer goes away. */
+  if (jack_client != NULL) jack_client_close(jack_client);
+  jack_client = NULL;
+  input = NULL;
+  output = NULL;
+
+  if (ringbuffer != NULL) jack_ringbuffer_free(ringbuffer);
+  ringbuffer = NULL;
+}
+
+int MidiEngine::process_callback(jack_nframes_t nframes, void *engine) {
+  return (static_cast<MidiEngine *>(engine)->process(nframes));
+}
+
+int MidiEngine::graph_order_callback(void *engine) {
+  MidiEngine *e = static_cast<MidiEngine *>(engine);
+
+  if (e->hooks.graph_changed) e->hooks.graph_changed(e->hooks.data);
+
+  return (0);
+}
+
+void MidiEngine::process_input(jack_nframes_t nframes) {
+  int read, events, i;
+  void *port_buffer;
+  jack_midi_event_t event;
+  MidiMessage message;
+  jack_nframes_t last_frame_time = jack_last_frame_time(jack_client);
+
+  port_buffer = jack_port_get_buffer(input, nframes);
+  if (port_buffer == NULL) {
+    warn("jack_port_get_buffer failed, cannot receive anything.");
+    return;
+  }
+
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+  events = jack_midi_get_event_count(port_buffer, nframes);
+#else
+  events = jack_midi_get_event_count(port_buffer);
+#endif
+
+  for (i = 0; i < events; i++) {
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+    read = jack_midi_event_get(&event, port_buffer, i, nframes);
+#else
+    read = jack_midi_event_get(&event, port_buffer, i);
+#endif
+    if (read) {
+      warn("jack_midi_event_get failed, RECEIVED NOTE LOST.");
+      lost.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    assert(event.size >= 1);
+
+    clock_follower.receive(event.buffer, event.size,
+                           last_frame_time + event.time);
+
+    if (!config.input_filter.passes(event.buffer, event.size)) continue;
+
+    if (event.size > 3) {
+      warn("Ignoring MIDI message longer than three bytes, probably a SysEx.");
+      continue;
+    }
+
+    message.len = event.size;
+    message.time = event.time;
+    memcpy(message.data, event.buffer, message.len);
+
+    if (hooks.received) hooks.received(message, hooks.data);
+  }
+}
+
+double MidiEngine::nframes_to_ms(jack_nframes_t nframes) const {
+  jack_nframes_t sr;
+
+  sr = jack_get_sample_rate(jack_client);
+
+  assert(sr > 0);
+
+  return ((nframes * 1000.0) / (double)sr);
+}
+
+/* A continuous control stepping to its new value during a cycle. */
+struct MidiEngine::Ramp {
+  int channel;
+  int slot;
+  int from;
+  int to;
+};
+
+/* What process_output() has sent so far this cycle. */
+struct MidiEngine::OutputCycle {
+  void *port_buffer;
+  jack_nframes_t nframes;
+  jack_nframes_t last_frame_time;
+  int bytes_remaining;
+  /* Time of the last message sent; JACK wants them in order. */
+  jack_nframes_t time;
+  /* The port buffer or the rate limit is used up. */
+  bool full;
+  /* The queue, read in place. */
+  jack_ringbuffer_data_t vec[2];
+  size_t available;
+  size_t consumed;
+  Ramp ramps[MAX_RAMPS];
+  int nramps;
+  /* The transport rolls with a known tempo, or a MIDI clock runs. */
+  bool rolling;
+  /* Beats since the song and since the bar started, at the start of the
+   * cycle. */
+  double beat;
+  double bar_beat;
+  double frames_per_beat;
+  /* Note value of a beat. */
+  double beat_type;
+  double beats_per_bar;
+};
+
+/* Bytes the message takes on a cable, where running status leaves out the
+ * status byte of messages with the same one as the last. */
+int MidiEngine::wire_length(const unsigned char *data, int len) const {
+  if (config.running_status && data[0] == running_status) return (len - 1);
+
+  return (len);
+}
+
+/* False if len more bytes would go over the rate limit, or nothing fits. */
+bool MidiEngine::has_room(OutputCycle &c, int len) {
+  if (c.full) return (false);
+
+  if (config.rate_limit > 0.0 && c.bytes_remaining - len <= 0) {
+    warn("Rate limiting in effect.");
+    c.full = true;
+    return (false);
+  }
+
+  return (true);
+}
+
+/* Sends a message at time t, or right after the last one sent if that was
+ * later.  False if the port buffer is full. */
+bool MidiEngine::reserve(OutputCycle &c, jack_nframes_t t,
+                         const unsigned char *data, int len) {
+  unsigned char *buffer;
+
+  if (t < c.time) t = c.time;
+
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+  buffer = jack_midi_event_reserve(c.port_buffer, t, len, c.nframes);
+#else
+  buffer = jack_midi_event_reserve(c.port_buffer, t, len);
+#endif
+
+  if (buffer == NULL) {
+    c.full = true;
+    return (false);
+  }
+
+  memcpy(buffer, data, len);
+  c.bytes_remaining -= wire_length(data, len);
+  if (hooks.sent) hooks.sent(c.last_frame_time + t, data, len, hooks.data);
+  c.time = t;
+
+  /* Realtime messages leave running status alone, other system ones end it. */
+  if (data[0] < 0xF0)
+    running_status = data[0];
+  else if (data[0] < 0xF8)
+    running_status = 0;
+
+  return (true);
+}
+
+/* Sends a control at time t, both halves of a 14 bit one.  False if it
+ * didn't fit. */
+bool MidiEngine::send_control(OutputCycle &c, jack_nframes_t t, int channel,
+                              int slot, int value) {
+  unsigned char data[6];
+  int len = 3, i;
+
+  if (slot == ControllerSlots::PITCH_BEND) {
+    data[0] = 0xE0 | channel;
+    data[1] = value & 0x7F;
+    data[2] = (value >> 7) & 0x7F;
+  } else if (slot >= ControllerSlots::FINE_CONTROLLERS) {
+    /* Coarse part first; receivers reset the fine part when it changes. */
+    data[0] = 0xB0 | channel;
+    data[1] = slot - ControllerSlots::FINE_CONTROLLERS;
+    data[2] = (value >> 7) & 0x7F;
+    data[3] = 0xB0 | channel;
+    data[4] = data[1] + 32;
+    data[5] = value & 0x7F;
+    len = 6;
+  } else {
+    data[0] = 0xB0 | channel;
+    data[1] = slot;
+    data[2] = value;
+  }
+
+  for (i = 0; i < len; i += 3) {
+    if (!has_room(c, wire_length(data + i, 3)) || !reserve(c, t, data + i, 3)) {
+      /* Half of a pair went out, whatever the receiver has now. */
+      if (i > 0) sent[channel][slot] = -1;
+      return (false);
+    }
+  }
+
+  sent[channel][slot] = value;
+
+  return (true);
+}
+
+/* Sends the continuous controls that changed at the start of the cycle, or
+ * sets up ramps to them. */
+void MidiEngine::send_controllers(OutputCycle &c) {
+  bool ramping = config.ramp_spacing > 0 && !config.time_offsets_are_zero;
+
+  controllers.drain([&](int channel, int slot, int value) {
+    int from = sent[channel][slot];
+
+    if (ramping && from >= 0 && abs(value - from) > 1 &&
+        c.nramps < MAX_RAMPS) {
+      c.ramps[c.nramps++] = {channel, slot, from, value};
+      return (true);
+    }
+
+    /* Stays set if it doesn't fit, it goes out next cycle. */
+    return (send_control(c, 0, channel, slot, value));
+  });
+}
+
+/*
+ * Steps every ramp from where it was to its new value, a step every
+ * ramp_spacing frames and the last one a step before the end of the cycle,
+ * with the queued messages that are due in between.  Only steps that change
+ * the value are sent.
+ */
+void MidiEngine::send_ramps(OutputCycle &c) {
+  jack_nframes_t spacing = config.ramp_spacing;
+  int steps = (c.nframes + spacing - 1) / spacing;
+  int step, i;
+
+  for (step = 1; step <= steps && !c.full; step++) {
+    jack_nframes_t t = (step - 1) * spacing;
+
+    send_queued(c, t);
+
+    for (i = 0; i < c.nramps; i++) {
+      const Ramp &r = c.ramps[i];
+      int value = r.from + (r.to - r.from) * step / steps;
+
+      if (value == sent[r.channel][r.slot]) continue;
+      if (!send_control(c, t, r.channel, r.slot, value)) break;
+    }
+  }
+
+  /* Ramps cut short go on from where they stopped next cycle. */
+  for (i = 0; i < c.nramps; i++) {
+    const Ramp &r = c.ramps[i];
+
+    if (sent[r.channel][r.slot] != r.to) controllers.mark(r.channel, r.slot);
+  }
+}
+
+/* Sends the queued messages due up to frame until of this cycle, and the
+ * held back ones due by then. */
+void MidiEngine::send_queued(OutputCycle &c, jack_nframes_t until) {
+  int t;
+  unsigned char data[3];
+
+  while (c.available - c.consumed >= sizeof(MidiMessage)) {
+    const MidiMessage &ev = *reinterpret_cast<const MidiMessage *>(
+        c.consumed < c.vec[0].len
+            ? c.vec[0].buf + c.consumed
+            : c.vec[1].buf + (c.consumed - c.vec[0].len));
+
+    t = ev.time + c.nframes - c.last_frame_time;
+
+    /* If computed time is too much into the future, we'll need
+       to send it later. */
+    if (t >= (int)c.nframes) break;
+
+    /* If computed time is < 0, we missed a cycle because of xrun. */
+    if (t < 0) t = 0;
+
+    if (config.time_offsets_are_zero) t = 0;
+
+    if (t > (int)until) break;
+
+    send_scheduled(c, t);
+
+    /* The arpeggiator plays the notes instead; they are in the mirror. */
+    if (config.arp.order != ARP_OFF && ev.len == 3 &&
+        ((ev.data[0] & 0xF0) == MIDI_NOTE_ON ||
+         (ev.data[0] & 0xF0) == MIDI_NOTE_OFF)) {
+      arpeggiator.played(ev.data);
+      c.consumed += sizeof(MidiMessage);
+      continue;
+    }
+
+    /* Recorded when it goes out, on the grid. */
+    if (schedule(c, ev, t)) {
+      c.consumed += sizeof(MidiMessage);
+      continue;
+    }
+
+    memcpy(data, ev.data, ev.len);
+    encode(data, ev.len);
+
+    if (!has_room(c, wire_length(data, ev.len))) return;
+
+    /* Left queued when the port buffer is full, for the next cycle. */
+    if (!reserve(c, t, data, ev.len)) {
+      warn("Port buffer full, sending the rest later.");
+      return;
+    }
+
+    c.consumed += sizeof(MidiMessage);
+    looper.record(t, ev.data, ev.len);
+    unschedule_notes(ev);
+  }
+
+  send_scheduled(c, until);
+}
+
+/* A note off as a note on shares its running status. */
+void MidiEngine::encode(unsigned char *data, int len) const {
+  if (config.running_status && len == 3 && (data[0] & 0xF0) == MIDI_NOTE_OFF) {
+    data[0] = MIDI_NOTE_ON | (data[0] & 0x0F);
+    data[2] = 0;
+  }
+}
+
+/* Reads where the transport is, for quantization, the arpeggiator and the
+ * looper; when it isn't rolling, where the MIDI clock is. */
+void MidiEngine::read_transport(OutputCycle &c) {
+  jack_position_t pos;
+
+  if (jack_transport_query(jack_client, &pos) != JackTransportRolling ||
+      !(pos.valid & JackPositionBBT) || pos.beats_per_minute <= 0.0) {
+    read_clock(c);
+    return;
+  }
+
+  c.rolling = true;
+  c.bar_beat = pos.beat - 1 + pos.tick / pos.ticks_per_beat;
+  c.beat = (pos.bar - 1) * pos.beats_per_bar + c.bar_beat;
+  c.frames_per_beat = pos.frame_rate * 60.0 / pos.beats_per_minute;
+  c.beat_type = pos.beat_type;
+  c.beats_per_bar = pos.beats_per_bar;
+}
+
+/* MIDI clock tells neither the bar nor the beat's note value; a bar is four
+ * quarter notes, counted from the song position. */
+void MidiEngine::read_clock(OutputCycle &c) {
+  const ClockPosition &clock = clock_follower.position();
+  int32_t ahead;
+
+  if (!clock.running || clock.tick < 0 || clock.frames_per_tick <= 0.0)
+    return;
+
+  c.rolling = true;
+  c.frames_per_beat = clock.frames_per_tick * ClockPosition::TICKS_PER_BEAT;
+  /* The latest tick may have come in during this cycle, past its start. */
+  ahead = clock.tick_frame - c.last_frame_time;
+  c.beat = clock.beat_at(c.last_frame_time) -
+           std::max(ahead, 0) / c.frames_per_beat;
+  c.beats_per_bar = 4;
+  c.beat_type = 4;
+  c.bar_beat = c.beat - floor(c.beat / c.beats_per_bar) * c.beats_per_bar;
+}
+
+/* How long a note on at frame t of this cycle waits for the grid. */
+jack_nframes_t MidiEngine::quantize_delay(const OutputCycle &c, int t) const {
+  double beat = c.bar_beat + t / c.frames_per_beat;
+  double grid = c.beat_type / config.quantize;
+  /* Within a frame of a grid line is on it. */
+  double on = 1.0 / c.frames_per_beat;
+  double next = ceil((beat - on) / grid) * grid;
+
+  return (lround(std::max(next - beat, 0.0) * config.quantize_strength *
+                 c.frames_per_beat));
+}
+
+/*
+ * Holds a note on back to its place on the grid, and a note off as long as
+ * its note on was, so the note keeps its length.  False if the message goes
+ * out now.
+ */
+bool MidiEngine::schedule(OutputCycle &c, const MidiMessage &ev, int t) {
+  int status = ev.data[0] & 0xF0, channel = ev.data[0] & 0x0F, note;
+  jack_nframes_t delay;
+  MidiMessage held = ev;
+
+  if (ev.len != 3 || (status != MIDI_NOTE_ON && status != MIDI_NOTE_OFF))
+    return (false);
+
+  note = ev.data[1] & 0x7F;
+
+  if (status == MIDI_NOTE_ON && ev.data[2] != 0)
+    delay = note_shift[channel][note] =
+        c.rolling && config.quantize > 0 ? quantize_delay(c, t) : 0;
+  else
+    delay = std::exchange(note_shift[channel][note], 0);
+
+  if (delay == 0) return (false);
+
+  held.time = c.last_frame_time + t + delay;
+  if (scheduled.hold(held.time, {held, true})) return (true);
+
+  /* No room to hold it, it goes out unquantized. */
+  note_shift[channel][note] = 0;
+  return (false);
+}
+
+/* Notes still held back would sound after an all notes off; drop them. */
+void MidiEngine::unschedule_notes(const MidiMessage &ev) {
+  int channel = ev.data[0] & 0x0F;
+  bool all = ev.data[0] == MIDI_RESET;
+
+  if (!all && !((ev.data[0] & 0xF0) == MIDI_CONTROLLER && ev.len == 3 &&
+                (ev.data[1] == MIDI_ALL_NOTES_OFF ||
+                 ev.data[1] == MIDI_ALL_SOUND_OFF)))
+    return;
+
+  scheduled.erase_if([&](const HeldMessage &held) {
+    return (all || (held.message.data[0] & 0x0F) == channel);
+  });
+
+  for (int c = 0; c < NoteMirror::CHANNELS; c++)
+    if (all || c == channel) std::fill_n(note_shift[c], 128, 0);
+
+  arpeggiator.reset();
+}
+
+/*
+ * Has the arpeggiator play this cycle's steps of the keys held on the lowest
+ * channel any are, on the transport's beat or else on its own, and holds
+ * back what it plays until its time.  The looper records the steps, not the
+ * keys.
+ */
+void MidiEngine::run_arpeggiator(OutputCycle &c) {
+  ArpEvent events[MAX_ARP_EVENTS];
+  NoteSet keys = {};
+  double beat, frames_per_beat, step;
+  int channel, n, i;
+
+  for (channel = 0; channel < NoteMirror::CHANNELS; channel++) {
+    /* Raced with the GUI; what was read last time will do. */
+    if (!mirror.read(channel, keys))
+      keys = channel == arp_channel ? arp_held : NoteSet{};
+
+    if (keys.any()) break;
+  }
+
+  if (channel == NoteMirror::CHANNELS) channel = arp_channel;
+  arp_channel = channel;
+  arp_held = keys;
+
+  if (c.rolling) {
+    beat = c.beat;
+    frames_per_beat = c.frames_per_beat;
+    step = c.beat_type / config.arp.rate;
+  } else {
+    beat = free_beat;
+    frames_per_beat =
+        jack_get_sample_rate(jack_client) * 60.0 / config.arp.tempo;
+    step = 4.0 / config.arp.rate;
+    free_beat += c.nframes / frames_per_beat;
+  }
+
+  n = arpeggiator.run(keys, channel, beat, frames_per_beat, step, c.nframes,
+                      events, MAX_ARP_EVENTS);
+
+  for (i = 0; i < n; i++) {
+    MidiMessage message = {0, 3, {}};
+
+    memcpy(message.data, events[i].data, 3);
+    if (!scheduled.hold(c.last_frame_time + events[i].time, {message, true}))
+      lost.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/* Carries out the loop actions asked for, and holds back what the loop plays
+ * this cycle until its time.  It plays past the arpeggiator, which it
+ * recorded the steps of. */
+void MidiEngine::run_looper(OutputCycle &c) {
+  double frames_per_bar =
+      c.rolling ? c.frames_per_beat * c.beats_per_bar : 0.0;
+
+  looper.cycle(c.nframes, frames_per_bar, c.bar_beat * c.frames_per_beat,
+               [&](jack_nframes_t t, const unsigned char *data, int len) {
+                 MidiMessage message = {0, len, {}};
+
+                 memcpy(message.data, data, len);
+                 if (!scheduled.hold(c.last_frame_time + t, {message, false}))
+                   lost.fetch_add(1, std::memory_order_relaxed);
+               });
+}
+
+/* Sends the held back messages due up to frame until of this cycle. */
+void MidiEngine::send_scheduled(OutputCycle &c, jack_nframes_t until) {
+  unsigned char data[3];
+
+  while (!scheduled.empty()) {
+    const HeldMessage &held = scheduled.peek();
+    const MidiMessage &ev = held.message;
+    int t = (int32_t)(scheduled.next_time() - c.last_frame_time);
+
+    if (t >= (int)c.nframes || t > (int)until) return;
+
+    /* Missed a cycle because of xrun. */
+    if (t < 0) t = 0;
+
+    if (config.time_offsets_are_zero) t = 0;
+
+    memcpy(data, ev.data, ev.len);
+    encode(data, ev.len);
+
+    if (!has_room(c, wire_length(data, ev.len))) return;
+
+    /* Left held back when the port buffer is full, a note off included. */
+    if (!reserve(c, t, data, ev.len)) {
+      warn("Port buffer full, sending the rest later.");
+      return;
+    }
+
+    if (held.recorded) looper.record(t, ev.data, ev.len);
+    scheduled.pop();
+  }
+}
+
+void MidiEngine::process_output(jack_nframes_t nframes) {
+  OutputCycle c = {};
+
+  c.nframes = nframes;
+  c.last_frame_time = jack_last_frame_time(jack_client);
+
+  c.port_buffer = jack_port_get_buffer(output, nframes);
+  if (c.port_buffer == NULL) {
+    warn("jack_port_get_buffer failed, cannot send anything.");
+    return;
+  }
+
+#ifdef JACK_MIDI_NEEDS_NFRAMES
+  jack_midi_clear_buffer(c.port_buffer, nframes);
+#else
+  jack_midi_clear_buffer(c.port_buffer);
+#endif
+
+  /* We may push at most one byte per 0.32ms to stay below 31.25 Kbaud limit. */
+  c.bytes_remaining = nframes_to_ms(nframes) * config.rate_limit;
+
+  read_transport(c);
+  if (config.arp.order != ARP_OFF) run_arpeggiator(c);
+  run_looper(c);
+
+  send_controllers(c);
+
+  /* Everything queued so far is taken at once and read in place, then
+   * released with a single advance. */
+  jack_ringbuffer_get_read_vector(ringbuffer, c.vec);
+  c.available = c.vec[0].len + c.vec[1].len;
+
+  if (c.nramps > 0) send_ramps(c);
+  send_queued(c, nframes);
+
+  jack_ringbuffer_read_advance(ringbuffer, c.consumed);
+}
+
+int MidiEngine::process(jack_nframes_t nframes) {
+#ifdef MEASURE_TIME
+  if (get_delta_time() > MAX_TIME_BETWEEN_CALLBACKS)
+    warn("Had to wait too long for JACK callback; scheduling problem?");
+#endif
+
+  /* Check for impossible condition that actually happened to me, caused by some
+   * problem between jackd and OSS4. */
+  if (nframes <= 0) {
+    warn("Process callback called with nframes = 0; bug in JACK?");
+    return 0;
+  }
+
+  process_input(nframes);
+  process_output(nframes);
+
+#ifdef MEASURE_TIME
+  if (get_delta_time() > MAX_PROCESSING_TIME)
+    warn("Processing took too long; scheduling problem?");
+#endif
+
+  return (0);
+}
+
+bool queue_policy_from_name(const char *name, QueuePolicy *policy) {
+  static const struct {
+    const char *name;
+    QueuePolicy policy;
+  } policies[] = {
+      {"drop-newest", QUEUE_DROP_NEWEST},
+      {"drop-oldest-cc", QUEUE_DROP_OLDEST_CC},
+      {"block", QUEUE_BLOCK},
+  };
+
+  for (const auto &p : policies) {
+    if (strcmp(name, p.name) == 0) {
+      *policy = p.policy;
+      return (true);
+    }
+  }
+
+  return (false);
+}
+
+MidiQueueStats MidiEngine::queue_stats() const {
+  /* The ringbuffer rounds up to a power of two and keeps a byte free. */
+  size_t capacity = (ringbuffer->size - 1) / sizeof(MidiMessage);
+
+  return {capacity, high_water, dropped, backlog.size(),
+          lost.load(std::memory_order_relaxed)};
+}
+
+void MidiEngine::update_high_water() {
+  size_t queued =
+      jack_ringbuffer_read_space(ringbuffer) / sizeof(MidiMessage) +
+      backlog.size();
+
+  if (queued > high_water) high_water = queued;
+}
+
+bool MidiEngine::push(const MidiMessage &ev) {
+  if (jack_ringbuffer_write_space(ringbuffer) < sizeof(ev)) return (false);
+
+  if (jack_ringbuffer_write(ringbuffer, (const char *)&ev, sizeof(ev)) !=
+      sizeof(ev))
+    return (false);
+
+  update_high_water();
+
+  return (true);
+}
+
+/* Messages a later one with the same key overrides: a controller change or
+ * pitch bend, per channel.  -1 for anything else. */
+int MidiEngine::override_key(const MidiMessage &ev) {
+  int channel = ev.data[0] & 0x0F;
+
+  if ((ev.data[0] & 0xF0) == 0xB0 && ev.len == 3)
+    return (channel * OVERRIDE_KEYS + ev.data[1]);
+
+  if ((ev.data[0] & 0xF0) == 0xE0) return (channel * OVERRIDE_KEYS + 128);
+
+  return (-1);
+}
+
+void MidiEngine::backlog_push(const MidiMessage &ev) {
+  int key = override_key(ev);
+
+  backlog.push_back(ev);
+  if (key >= 0) held[key]++;
+}
+
+void MidiEngine::backlog_erase(size_t i) {
+  int key = override_key(backlog[i]);
+
+  backlog.erase(backlog.begin() + i);
+  if (key >= 0) held[key]--;
+}
+
+bool MidiEngine::hold_back(const MidiMessage &ev) {
+  if (backlog.size() >= config.queue_size) {
+    int new_key = override_key(ev);
+    size_t i;
+
+    /* Make room by dropping the oldest message something after it, the new
+     * one included, overrides. */
+    for (i = 0; i < backlog.size(); i++) {
+      int key = override_key(backlog[i]);
+
+      if (key >= 0 && (held[key] > 1 || key == new_key)) break;
+    }
+
+    if (i == backlog.size()) return (false);
+
+    backlog_erase(i);
+    dropped++;
+  }
+
+  backlog_push(ev);
+  update_high_water();
+
+  return (true);
+}
+
+bool MidiEngine::wait_for_room(const MidiMessage &ev) {
+  typedef std::chrono::steady_clock clock;
+  clock::time_point deadline =
+      clock::now() + std::chrono::duration_cast<clock::duration>(
+                         std::chrono::duration<double, std::milli>(
+                             config.block_ms));
+
+  do {
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    if (push(ev)) return (true);
+  } while (clock::now() < deadline);
+
+  return (false);
+}
+
+void MidiEngine::flush() {
+  while (!backlog.empty() && push(backlog.front())) backlog_erase(0);
+}
+
+bool MidiEngine::queue(const MidiMessage &ev) {
+  bool queued;
+
+  /* Anything held back goes first, to keep messages in order. */
+  flush();
+
+  if (backlog.empty() && push(ev)) {
+    queued = true;
+  } else if (config.queue_policy == QUEUE_DROP_OLDEST_CC) {
+    queued = hold_back(ev);
+  } else if (config.queue_policy == QUEUE_BLOCK) {
+    queued = wait_for_room(ev);
+  } else {
+    queued = false;
+  }
+
+  if (!queued) {
+    dropped++;
+    return (false);
+  }
+
+  mirror.update(ev.data, ev.len);
+
+  return (true);
+}
+
+MidiMessage MidiEngine::new_message(int b0, int b1, int b2) const {
+  MidiMessage ev;
+
+  /* For MIDI messages that specify a channel number, filter the original
+     channel number out and add our own. */
+  if (b0 >= 0x80 && b0 <= 0xEF) {
+    b0 &= 0xF0;
+    b0 += current_channel;
+  }
+
+  if (b1 == -1) {
+    ev.len = 1;
+    ev.data[0] = b0;
+
+  } else if (b2 == -1) {
+    ev.len = 2;
+    ev.data[0] = b0;
+    ev.data[1] = b1;
+
+  } else {
+    ev.len = 3;
+    ev.data[0] = b0;
+    ev.data[1] = b1;
+    ev.data[2] = b2;
+  }
+
+  ev.time = jack_frame_time(jack_client);
+
+  return (ev);
+}
+
+bool MidiEngine::queue_new(int b0, int b1, int b2) {
+  return (queue(new_message(b0, b1, b2)));
+}
+
+bool MidiEngine::queue_batch(std::span<const MidiMessage> messages) {
+  jack_ringbuffer_data_t vec[2];
+  size_t bytes = messages.size_bytes(), first;
+  bool queued = true;
+
+  flush();
+
+  /* Without room for all of them, the queue policy decides one by one. */
+  if (!backlog.empty() || jack_ringbuffer_write_space(ringbuffer) < bytes) {
+    for (const MidiMessage &ev : messages) queued = queue(ev) && queued;
+
+    return (queued);
+  }
+
+  jack_ringbuffer_get_write_vector(ringbuffer, vec);
+  first = std::min(bytes, vec[0].len);
+  memcpy(vec[0].buf, messages.data(), first);
+  memcpy(vec[1].buf, (const char *)messages.data() + first, bytes - first);
+  jack_ringbuffer_write_advance(ringbuffer, bytes);
+
+  update_high_water();
+  for (const MidiMessage &ev : messages) mirror.update(ev.data, ev.len);
+
+  return (true);
+}
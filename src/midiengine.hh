@@ -0,0 +1,339 @@
+#pragma once
+
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <span>
+
+#include "arpeggiator.hh"
+#include "clockfollower.hh"
+#include "controllerslots.hh"
+#include "eventscheduler.hh"
+#include "looper.hh"
+#include "midifilter.hh"
+#include "notemirror.hh"
+
+/*
+ * Padded to 16 bytes, so messages tile the power of two sized ringbuffer:
+ * none is split by its end, and each can be read where it lies.
+ */
+struct alignas(16) MidiMessage {
+  jack_nframes_t time;
+  int len; /* Length of MIDI message, in bytes. */
+  unsigned char data[3];
+};
+
+static_assert(sizeof(MidiMessage) == 16);
+
+/* What queue() does when the output queue is full. */
+enum QueuePolicy {
+  /* Refuse the new message. */
+  QUEUE_DROP_NEWEST,
+  /* Hold messages back on the producer's side until flush() finds room; when
+   * queue_size are held back, drop the oldest controller change or pitch
+   * bend that a later one overrides, else the new message. */
+  QUEUE_DROP_OLDEST_CC,
+  /* Wait up to block_ms for room, then refuse.  Not for realtime producers. */
+  QUEUE_BLOCK,
+};
+
+// "drop-newest", "drop-oldest-cc" or "block"; false if name is none of them
+bool queue_policy_from_name(const char *name, QueuePolicy *policy);
+
+struct MidiQueueStats {
+  size_t capacity;   // messages the queue holds
+  size_t high_water; // most messages queued or held back at once
+  size_t dropped;    // messages lost to a full queue
+  size_t backlog;    // messages held back now
+  size_t lost;       // messages lost in the process callback
+};
+
+struct MidiEngineConfig {
+  const char *client_name = "jack-keyboard";
+  // bytes per millisecond the output may send, 0 for no limit
+  double rate_limit = 0.0;
+  // send every message at the start of the cycle instead of at its time
+  bool time_offsets_are_zero = false;
+  // messages the output queue holds, rounded up to a power of two, less
+  // one, so 1024 holds 1023; queue_stats() tells how many
+  size_t queue_size = 1024;
+  QueuePolicy queue_policy = QUEUE_DROP_NEWEST;
+  // how long QUEUE_BLOCK waits for room
+  double block_ms = 5.0;
+  // frames between the steps a continuous control ramps to a new value in,
+  // 0 to send the new value at once
+  jack_nframes_t ramp_spacing = 0;
+  // send note offs as note ons with velocity 0, and count what running
+  // status leaves out against the rate limit, for outputs bridged to a cable
+  bool running_status = false;
+  // incoming messages that reach the received hook
+  MidiFilter input_filter;
+  // while the JACK transport rolls, hold note ons back to a grid of this
+  // note value, 16 for sixteenths; 0 not to
+  int quantize = 0;
+  // how far towards the grid notes move, 0 - 1
+  double quantize_strength = 1.0;
+  // plays the keys held instead of sending them, unless order is ARP_OFF
+  ArpConfig arp;
+};
+
+/**
+ * What the engine tells its user.  All of them are called from the JACK
+ * thread, so they must neither block nor take long; the GUI hands them over
+ * to its own thread with g_idle_add().
+ */
+struct MidiEngineHooks {
+  // something went wrong, message is a string literal
+  void (*warning)(const char *message, void *data) = NULL;
+  // a message of at most three bytes arrived on the input port, and passed
+  // the input_filter
+  void (*received)(const MidiMessage &message, void *data) = NULL;
+  // ports were connected or disconnected
+  void (*graph_changed)(void *data) = NULL;
+  // a message went out on the output port at frame time, as counted by
+  // jack_last_frame_time(); for recording what is played
+  void (*sent)(jack_nframes_t time, const unsigned char *message, int len,
+               void *data) = NULL;
+  void *data = NULL;
+};
+
+/**
+ * The MIDI side of jack-keyboard, without any GUI: a JACK client with an
+ * input and an output port, the queue of messages waiting to go out and the
+ * notes that are sounding.
+ *
+ * Messages are queued by a single thread through a lock free ring buffer, and
+ * the process callback sends them when their time comes, at most rate_limit
+ * bytes per millisecond.  What happens when the queue is full is up to the
+ * queue_policy; either way it is counted, and never blocks the JACK thread.
+ */
+class MidiEngine {
+ public:
+  MidiEngine(MidiEngineHooks hooks = {}) : hooks(hooks) {}
+
+  MidiEngine(const MidiEngine &) = delete;
+
+  MidiEngine &operator=(const MidiEngine &) = delete;
+
+  ~MidiEngine() { close(); }
+
+  // opens the client and registers the ports; NULL, or what failed
+  const char *open(const MidiEngineConfig &config);
+
+  // starts processing; NULL, or what failed
+  const char *activate();
+
+  void close();
+
+  jack_client_t *client() const { return jack_client; }
+
+  jack_port_t *input_port() const { return input; }
+
+  jack_port_t *output_port() const { return output; }
+
+  // 0 - 15, what queue_new() sends on
+  int channel() const { return current_channel; }
+
+  void set_channel(int channel) { current_channel = channel; }
+
+  // queues a message for output; false if it was dropped for want of room
+  bool queue(const MidiMessage &message);
+
+  /**
+   * Queues a message to be sent right away on the current channel.  b1 and
+   * b2 are -1 for messages shorter than three bytes.
+   */
+  bool queue_new(int b0, int b1, int b2);
+
+  // the message queue_new() would send
+  MidiMessage new_message(int b0, int b1, int b2) const;
+
+  /**
+   * Queues messages so the JACK thread sees all of them at once, or, if
+   * they don't all fit, one by one as queue() would.  False if any of them
+   * was dropped.
+   */
+  bool queue_batch(std::span<const MidiMessage> messages);
+
+  /**
+   * Sets a controller, or the pitch bend, on the current channel.  Unlike
+   * queue_new(), only the value set last before a cycle is sent, at its
+   * start, so use it for continuous controls and not for pedals or anything
+   * that must keep its order with the notes.  With a ramp_spacing, the
+   * value is reached in steps over the cycle instead.
+   */
+  void set_controller(int controller, int value) {
+    controllers.set(current_channel, controller, value);
+  }
+
+  // controller is 0 - 31, value 0 - 16383; sent as controller and
+  // controller + 32
+  void set_controller_14bit(int controller, int value) {
+    controllers.set(current_channel,
+                    ControllerSlots::FINE_CONTROLLERS + controller, value);
+  }
+
+  // value is 0 - 16383, 8192 is centered; 16384, the top of a range
+  // centered on 8192, is sent as 16383
+  void set_pitch_bend(int value) {
+    controllers.set(current_channel, ControllerSlots::PITCH_BEND,
+                    std::clamp(value, 0, 16383));
+  }
+
+  // moves messages held back by QUEUE_DROP_OLDEST_CC into the queue
+  void flush();
+
+  // messages are held back, flush() should be called again soon
+  bool backlogged() const { return (!backlog.empty()); }
+
+  // queueing thread only, like queue(), but for lost
+  MidiQueueStats queue_stats() const;
+
+  // notes sent and not released yet, readable from any thread
+  const NoteMirror &sounding_notes() const { return mirror; }
+
+  // the MIDI clock received on the input port, whether filtered out or not;
+  // quantization, the arpeggiator and the looper follow it while it runs
+  // and the JACK transport doesn't roll
+  const ClockFollower &clock() const { return clock_follower; }
+
+  /**
+   * Records what is queued into a loop and plays it back, from the next
+   * cycle on.  Loops recorded while the transport rolls are whole bars.
+   */
+  void loop(LoopAction action) { looper.request(action); }
+
+  LoopState loop_state() const { return looper.state(); }
+
+  // one cycle of the process callback
+  int process(jack_nframes_t nframes);
+
+ private:
+  // controllers, and pitch bend
+  static constexpr int OVERRIDE_KEYS = 129;
+
+  // controls ramping at once, any more jump to their new value
+  static constexpr int MAX_RAMPS = 16;
+
+  // messages held back at once; any more notes go out unquantized, and
+  // arpeggiated or looped ones are lost
+  static constexpr int SCHEDULED_MESSAGES = 1024;
+
+  // messages the arpeggiator plays in a cycle at most
+  static constexpr int MAX_ARP_EVENTS = 64;
+
+  struct Ramp;
+
+  struct OutputCycle;
+
+  // a message held back, and whether the looper records it once it goes out;
+  // not what the loop plays itself
+  struct HeldMessage {
+    MidiMessage message;
+    bool recorded;
+  };
+
+  static int override_key(const MidiMessage &message);
+
+  static int process_callback(jack_nframes_t nframes, void *engine);
+
+  static int graph_order_callback(void *engine);
+
+  void process_input(jack_nframes_t nframes);
+
+  void process_output(jack_nframes_t nframes);
+
+  int wire_length(const unsigned char *data, int len) const;
+
+  bool has_room(OutputCycle &c, int len);
+
+  bool reserve(OutputCycle &c, jack_nframes_t t, const unsigned char *data,
+               int len);
+
+  bool send_control(OutputCycle &c, jack_nframes_t t, int channel, int slot,
+                    int value);
+
+  void send_controllers(OutputCycle &c);
+
+  void send_ramps(OutputCycle &c);
+
+  void send_queued(OutputCycle &c, jack_nframes_t until);
+
+  void encode(unsigned char *data, int len) const;
+
+  void read_transport(OutputCycle &c);
+
+  void read_clock(OutputCycle &c);
+
+  jack_nframes_t quantize_delay(const OutputCycle &c, int t) const;
+
+  bool schedule(OutputCycle &c, const MidiMessage &ev, int t);
+
+  void unschedule_notes(const MidiMessage &ev);
+
+  void send_scheduled(OutputCycle &c, jack_nframes_t until);
+
+  void run_arpeggiator(OutputCycle &c);
+
+  void run_looper(OutputCycle &c);
+
+  double nframes_to_ms(jack_nframes_t nframes) const;
+
+  void update_high_water();
+
+  bool push(const MidiMessage &message);
+
+  void backlog_push(const MidiMessage &message);
+
+  void backlog_erase(size_t i);
+
+  bool hold_back(const MidiMessage &message);
+
+  bool wait_for_room(const MidiMessage &message);
+
+  void warn(const char *message) {
+    if (hooks.warning) hooks.warning(message, hooks.data);
+  }
+
+  MidiEngineHooks hooks;
+  MidiEngineConfig config;
+  jack_client_t *jack_client = NULL;
+  jack_port_t *input = NULL;
+  jack_port_t *output = NULL;
+  jack_ringbuffer_t *ringbuffer = NULL;
+  int current_channel = 0;
+  NoteMirror mirror;
+  ClockFollower clock_follower;
+  ControllerSlots controllers;
+  // JACK thread side: the value each control was last sent with, -1 if
+  // unknown, for ramps to start from
+  short sent[ControllerSlots::CHANNELS][ControllerSlots::SLOTS];
+  // JACK thread side: the status byte a cable would be running with, 0 if
+  // none
+  unsigned char running_status = 0;
+  // JACK thread side: messages received, arpeggiated or looped that were
+  // lost, readable from any thread
+  std::atomic<size_t> lost{0};
+  // JACK thread side: messages held back by quantization, by when they go
+  // out, and how far each sounding note was moved, for its note off to
+  // follow it
+  EventScheduler<HeldMessage, SCHEDULED_MESSAGES> scheduled;
+  jack_nframes_t note_shift[NoteMirror::CHANNELS][128] = {};
+  // JACK thread side: the arpeggiator, the keys it plays and its beat when
+  // the transport gives none
+  Arpeggiator arpeggiator;
+  NoteSet arp_held = {};
+  int arp_channel = 0;
+  double free_beat = 0.0;
+  // records on the JACK thread, asked to from any
+  Looper looper;
+  // queueing thread side of the queue
+  std::deque<MidiMessage> backlog;
+  // held back messages per controller and channel, and pitch bends
+  unsigned short held[NoteMirror::CHANNELS * OVERRIDE_KEYS] = {};
+  size_t high_water = 0;
+  size_t dropped = 0;
+};
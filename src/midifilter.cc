@@ -0,0 +1,81 @@
+#include "midifilter.hh"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string_view>
+
+#include "midi.hh"
+#include "util.hh"
+
+void MidiFilter::drop_status(int status) {
+  if (status >= 0xF0)
+    system.set(status & 0x0F);
+  else if (status >= 0x80)
+    channel_kinds.set((status >> 4) - 8);
+}
+
+void MidiFilter::drop_channel(int channel) { channels |= 1 << channel; }
+
+void MidiFilter::drop_controller(int controller) {
+  controllers.set(controller);
+}
+
+bool MidiFilter::drop(const char *list) {
+  static const struct {
+    const char *name;
+    int status;
+  } names[] = {
+      {"note-off", MIDI_NOTE_OFF},
+      {"note-on", MIDI_NOTE_ON},
+      {"key-pressure", 0xA0},
+      {"controller", MIDI_CONTROLLER},
+      {"program", MIDI_PROGRAM_CHANGE},
+      {"channel-pressure", 0xD0},
+      {"pitch-bend", MIDI_PITCH},
+      {"sysex", 0xF0},
+      {"time-code", 0xF1},
+      {"song-position", 0xF2},
+      {"song-select", 0xF3},
+      {"tune-request", 0xF6},
+      {"clock", MIDI_CLOCK},
+      {"start", MIDI_START},
+      {"continue", MIDI_CONTINUE},
+      {"stop", MIDI_STOP},
+      {"sensing", MIDI_ACTIVE_SENSING},
+      {"reset", MIDI_RESET},
+  };
+  char *copy = strdup(list), *saveptr = NULL;
+  bool valid = true;
+
+  for (char *item = strtok_r(copy, ",", &saveptr); valid && item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    std::string_view name = item;
+    std::optional<int> number;
+
+    if (name == "realtime") {
+      for (int status = MIDI_CLOCK; status <= MIDI_RESET; status++)
+        drop_status(status);
+    } else if (name.starts_with("channel=")) {
+      number = parse_int(name.substr(strlen("channel=")));
+      valid = number && *number >= 1 && *number <= 16;
+      if (valid) drop_channel(*number - 1);
+    } else if (name.starts_with("controller=")) {
+      number = parse_int(name.substr(strlen("controller=")));
+      valid = number && *number >= 0 && *number <= 127;
+      if (valid) drop_controller(*number);
+    } else {
+      valid = false;
+      for (const auto &n : names) {
+        if (name == n.name) {
+          drop_status(n.status);
+          valid = true;
+        }
+      }
+    }
+  }
+
+  free(copy);
+
+  return valid;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <bitset>
+
+/**
+ * Which incoming messages to keep, by status, channel and controller
+ * number.  The JACK thread checks every message that arrives against it
+ * before handing it over to anyone, so unwanted traffic such as MIDI clock
+ * or active sensing costs a few bit tests and nothing else.
+ *
+ * Everything passes until told otherwise.  Set it up before the engine is
+ * activated; it is not changed while running.
+ */
+class MidiFilter {
+ public:
+  // drops messages with this status byte, or this kind of channel message
+  void drop_status(int status);
+
+  // drops channel messages on channel 0 - 15
+  void drop_channel(int channel);
+
+  // drops changes of controller 0 - 127
+  void drop_controller(int controller);
+
+  /**
+   * Drops what a comma separated list names: note-off, note-on,
+   * key-pressure, controller, program, channel-pressure, pitch-bend, sysex,
+   * time-code, song-position, song-select, tune-request, clock, start,
+   * continue, stop, sensing, reset, realtime (all of clock to reset),
+   * channel=<1 - 16> and controller=<0 - 127>.  False if anything in it is
+   * none of them.
+   */
+  bool drop(const char *list);
+
+  bool passes(const unsigned char *data, int len) const {
+    int status = data[0];
+
+    if (status < 0x80) return true;
+    if (status >= 0xF0) return !system[status & 0x0F];
+    if (channel_kinds[(status >> 4) - 8]) return false;
+    if (channels & (1 << (status & 0x0F))) return false;
+
+    return !((status & 0xF0) == 0xB0 && len >= 2 &&
+             controllers[data[1] & 0x7F]);
+  }
+
+ private:
+  // note off to pitch bend
+  std::bitset<7> channel_kinds;
+  // 0xF0 - 0xFF
+  std::bitset<16> system;
+  uint16_t channels = 0;
+  std::bitset<128> controllers;
+};
@@ -0,0 +1,174 @@
+#include "midirecorder.hh"
+
+#include <math.h>
+
+#include <chrono>
+
+const char *MidiRecorder::open(const char *path, jack_nframes_t rate) {
+  /* Format 0, a single track, and the track, starting with the tempo; its
+   * length comes later. */
+  static const unsigned char header[] = {
+      'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, TICKS_PER_BEAT >> 8,
+      TICKS_PER_BEAT & 0xFF, 'M', 'T', 'r', 'k', 0, 0, 0, 0, 0x00, 0xFF, 0x51,
+      0x03, (MICROSECONDS_PER_BEAT >> 16) & 0xFF,
+      (MICROSECONDS_PER_BEAT >> 8) & 0xFF, MICROSECONDS_PER_BEAT & 0xFF};
+
+  close();
+
+  ring = jack_ringbuffer_create(RING_MESSAGES * sizeof(Event));
+  if (ring == NULL) return ("Cannot create JACK ringbuffer.");
+
+  jack_ringbuffer_mlock(ring);
+
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    jack_ringbuffer_free(ring);
+    ring = NULL;
+    return ("Cannot create the MIDI file.");
+  }
+
+  setvbuf(file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+
+  sample_rate = rate;
+  failed = false;
+  started = false;
+  frames = 0;
+  ticks = 0;
+  running_status = 0;
+  lost_count.store(0, std::memory_order_relaxed);
+
+  put(header, sizeof(header));
+  /* Past the header and the track's tag, and past the length. */
+  track_length_at = 18;
+  track_start = 22;
+
+  stopping.store(false, std::memory_order_relaxed);
+  writer = std::thread(&MidiRecorder::run, this);
+
+  return (NULL);
+}
+
+const char *MidiRecorder::close() {
+  static const unsigned char end_of_track[] = {0x00, 0xFF, 0x2F, 0x00};
+
+  if (file == NULL) return (NULL);
+
+  stopping.store(true, std::memory_order_release);
+  writer.join();
+
+  put(end_of_track, sizeof(end_of_track));
+  write_track_length();
+  if (fclose(file) != 0) failed = true;
+  file = NULL;
+
+  jack_ringbuffer_free(ring);
+  ring = NULL;
+
+  return (failed ? "Writing the MIDI file failed." : NULL);
+}
+
+void MidiRecorder::record(jack_nframes_t time, const unsigned char *data,
+                          int len) {
+  Event event = {time, (uint8_t)len, {}};
+
+  if (ring == NULL || len < 1 || len > 3) return;
+
+  if (data[0] < 0x80 || data[0] >= 0xF0) return;
+
+  if (jack_ringbuffer_write_space(ring) < sizeof(Event)) {
+    lost_count.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  for (int i = 0; i < len; i++) event.data[i] = data[i];
+
+  jack_ringbuffer_write(ring, (const char *)&event, sizeof(Event));
+}
+
+void MidiRecorder::run() {
+  auto flushed = std::chrono::steady_clock::now();
+
+  while (!stopping.load(std::memory_order_acquire)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(WRITE_INTERVAL_MS));
+
+    write_events();
+
+    if (std::chrono::steady_clock::now() - flushed >=
+        std::chrono::milliseconds(FLUSH_INTERVAL_MS)) {
+      write_track_length();
+      if (fflush(file) != 0) failed = true;
+      flushed = std::chrono::steady_clock::now();
+    }
+  }
+
+  /* What came in while the last write ran. */
+  write_events();
+}
+
+void MidiRecorder::write_events() {
+  Event event;
+
+  while (jack_ringbuffer_read(ring, (char *)&event, sizeof(Event)) ==
+         sizeof(Event))
+    write_event(event);
+}
+
+void MidiRecorder::write_event(const Event &event) {
+  uint64_t tick;
+
+  /* Unsigned, so frame time wrapping around goes on counting up. */
+  if (started) frames += (jack_nframes_t)(event.time - last_time);
+  started = true;
+  last_time = event.time;
+
+  /* Rounded from the total, so rounding errors don't add up. */
+  tick = llround(frames * (TICKS_PER_BEAT * 1e6 / MICROSECONDS_PER_BEAT) /
+                 sample_rate);
+  write_variable_length(tick - ticks);
+  ticks = tick;
+
+  if (event.data[0] == running_status) {
+    put(event.data + 1, event.len - 1);
+  } else {
+    put(event.data, event.len);
+    running_status = event.data[0];
+  }
+}
+
+void MidiRecorder::write_variable_length(uint32_t value) {
+  unsigned char bytes[5];
+  int n = 0;
+
+  /* Seven bits a byte, most significant first, all but the last with the
+   * top bit set. */
+  do {
+    bytes[4 - n] = (value & 0x7F) | (n > 0 ? 0x80 : 0);
+    value >>= 7;
+    n++;
+  } while (value != 0);
+
+  put(bytes + 5 - n, n);
+}
+
+/* Sets the track length to what is written so far, staying at the end. */
+void MidiRecorder::write_track_length() {
+  long end = ftell(file);
+  uint32_t length = end - track_start;
+  unsigned char bytes[4] = {(unsigned char)(length >> 24),
+                            (unsigned char)(length >> 16),
+                            (unsigned char)(length >> 8),
+                            (unsigned char)length};
+
+  if (end < 0 || fseek(file, track_length_at, SEEK_SET) != 0) {
+    failed = true;
+    return;
+  }
+
+  put(bytes, sizeof(bytes));
+
+  if (fseek(file, end, SEEK_SET) != 0) failed = true;
+}
+
+void MidiRecorder::put(const unsigned char *data, size_t len) {
+  if (fwrite(data, 1, len, file) != len) failed = true;
+}
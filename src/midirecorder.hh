@@ -0,0 +1,108 @@
+#pragma once
+
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+
+/**
+ * Writes what the engine sends to a Standard MIDI File of type 0, while it
+ * is sent.
+ *
+ * The JACK thread copies every message, with its frame time, into a lock
+ * free ring buffer with record(), which never blocks.  A writer thread
+ * empties the ring every WRITE_INTERVAL_MS into a buffered file, and every
+ * FLUSH_INTERVAL_MS fixes up the track length and flushes, so the file on
+ * disk is readable while the recording runs and a crash loses little.
+ * Memory stays the same however long the recording; if the writer falls a
+ * whole ring behind, messages are lost and counted.
+ *
+ * Time starts at the first message, at 120 beats per minute.  Only channel
+ * messages are written, a file has no place for the others.
+ */
+class MidiRecorder {
+ public:
+  MidiRecorder() = default;
+
+  MidiRecorder(const MidiRecorder &) = delete;
+
+  MidiRecorder &operator=(const MidiRecorder &) = delete;
+
+  ~MidiRecorder() { close(); }
+
+  /**
+   * Creates the file at path and starts the writer; NULL, or what failed.
+   * Call it before the engine is activated, and close() after it is closed,
+   * so record() is never running meanwhile.
+   */
+  const char *open(const char *path, jack_nframes_t sample_rate);
+
+  // writes what is left and ends the file; NULL, or what failed
+  const char *close();
+
+  // JACK thread: a message sent at frame time, as from jack_last_frame_time()
+  void record(jack_nframes_t time, const unsigned char *data, int len);
+
+  // messages that found the ring full, readable from any thread
+  size_t lost() const { return lost_count.load(std::memory_order_relaxed); }
+
+ private:
+  // messages the ring holds; at 20 ms between writes, far more than a MIDI
+  // port can send
+  static constexpr size_t RING_MESSAGES = 4096;
+
+  static constexpr int WRITE_INTERVAL_MS = 20;
+
+  static constexpr int FLUSH_INTERVAL_MS = 1000;
+
+  static constexpr size_t FILE_BUFFER_SIZE = 64 * 1024;
+
+  static constexpr int TICKS_PER_BEAT = 960;
+
+  static constexpr int MICROSECONDS_PER_BEAT = 500000;
+
+  // 8 bytes, so messages tile the power of two sized ring
+  struct Event {
+    jack_nframes_t time;
+    uint8_t len;
+    unsigned char data[3];
+  };
+
+  static_assert(sizeof(Event) == 8);
+
+  void run();
+
+  void write_events();
+
+  void write_event(const Event &event);
+
+  void write_variable_length(uint32_t value);
+
+  void write_track_length();
+
+  void put(const unsigned char *data, size_t len);
+
+  jack_ringbuffer_t *ring = NULL;
+  std::thread writer;
+  std::atomic<bool> stopping{false};
+  std::atomic<size_t> lost_count{0};
+
+  // writer thread only from here on, and open() and close()
+  FILE *file = NULL;
+  bool failed = false;
+  jack_nframes_t sample_rate = 0;
+  // where the track's length is, and where its events start
+  long track_length_at = 0;
+  long track_start = 0;
+  // time of the latest message written, and the frames and ticks since the
+  // first, kept in 64 bits across frame time wrapping
+  bool started = false;
+  jack_nframes_t last_time = 0;
+  uint64_t frames = 0;
+  uint64_t ticks = 0;
+  // the status byte the file is running with, 0 if none
+  unsigned char running_status = 0;
+};
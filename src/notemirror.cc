@@ -0,0 +1,66 @@
+#include "notemirror.hh"
+
+#include "midi.hh"
+
+void NoteMirror::publish(int channel) {
+  Slot &slot = slots[channel];
+  uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+
+  slot.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (unsigned int w = 0; w < NoteSet::WORDS; w++)
+    slot.words[w].store(slot.local.words[w], std::memory_order_relaxed);
+
+  slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+void NoteMirror::note_on(int channel, int note) {
+  if (slots[channel].local.test(note)) return;
+
+  slots[channel].local.set(note);
+  publish(channel);
+}
+
+void NoteMirror::note_off(int channel, int note) {
+  if (!slots[channel].local.test(note)) return;
+
+  slots[channel].local.reset(note);
+  publish(channel);
+}
+
+void NoteMirror::all_notes_off(int channel) {
+  if (!slots[channel].local.any()) return;
+
+  slots[channel].local.clear();
+  publish(channel);
+}
+
+void NoteMirror::reset() {
+  for (int channel = 0; channel < CHANNELS; channel++) all_notes_off(channel);
+}
+
+void NoteMirror::update(const unsigned char *data, int len) {
+  if (len < 1) return;
+
+  if (data[0] == MIDI_RESET) {
+    reset();
+    return;
+  }
+
+  if (len < 3) return;
+
+  int status = data[0] & 0xF0;
+  int channel = data[0] & 0x0F;
+
+  if (status == MIDI_NOTE_ON && data[2] != 0) {
+    note_on(channel, data[1] & 0x7F);
+
+  } else if (status == MIDI_NOTE_ON || status == MIDI_NOTE_OFF) {
+    note_off(channel, data[1] & 0x7F);
+
+  } else if (status == MIDI_CONTROLLER && (data[1] == MIDI_ALL_NOTES_OFF ||
+                                           data[1] == MIDI_ALL_SOUND_OFF)) {
+    all_notes_off(channel);
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+
+#include "notestate.hh"
+
+/**
+ * Per channel set of sounding notes, published so the JACK thread can read
+ * it without locks and without touching any GTK object.
+ *
+ * There is exactly one writer, the GTK thread, which feeds every message it
+ * queues for output through update().  Each channel is a small seqlock:
+ * readers never wait for the writer, read() simply reports failure if it
+ * raced with an update and the caller keeps its previous snapshot.
+ */
+class NoteMirror {
+ public:
+  static constexpr int CHANNELS = 16;
+
+  // writer side, GTK thread only
+
+  void note_on(int channel, int note);
+
+  void note_off(int channel, int note);
+
+  void all_notes_off(int channel);
+
+  void reset();
+
+  // tracks note on/off, all notes/sound off and reset messages
+  void update(const unsigned char *data, int len);
+
+  // reader side, wait free
+
+  /**
+   * Copies the sounding notes of channel into out.  Returns false, leaving
+   * out untouched, if an update was in progress.
+   */
+  bool read(int channel, NoteSet &out) const {
+    const Slot &slot = slots[channel];
+    NoteSet snapshot;
+
+    uint32_t before = slot.seq.load(std::memory_order_acquire);
+    if (before & 1) return false;
+
+    for (unsigned int w = 0; w < NoteSet::WORDS; w++)
+      snapshot.words[w] = slot.words[w].load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != before) return false;
+
+    out = snapshot;
+    return true;
+  }
+
+  // a single note lives in a single word, so this one is always consistent
+  bool sounding(int channel, int note) const {
+    return (slots[channel].words[note / 64].load(std::memory_order_relaxed) &
+            NoteSet::bit(note)) != 0;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> seq{0};
+    std::atomic<uint64_t> words[NoteSet::WORDS]{};
+    // writer's private copy, published by publish()
+    NoteSet local{};
+  };
+
+  void publish(int channel);
+
+  Slot slots[CHANNELS];
+};
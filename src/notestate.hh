@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <bit>
+
+// number of MIDI notes, 0 (C-1) - 127 (G9)
+#define NNOTES 128
+
+/**
+ * Fixed size set of bits, stored as plain 64 bit words.
+ *
+ * Unlike std::bitset the words are accessible, so set operations such as
+ * "sustained and not pressed" are a couple of word instructions, and
+ * for_each() only visits the bits that are set.  It has no constructor so it
+ * can live inside zero-filled C structs (GObject instances, for one).
+ */
+template <unsigned int N>
+struct BitSet {
+  static constexpr unsigned int WORDS = (N + 63) / 64;
+
+  uint64_t words[WORDS];
+
+  static constexpr uint64_t bit(unsigned int i) {
+    return uint64_t{1} << (i % 64);
+  }
+
+  void set(unsigned int i) { words[i / 64] |= bit(i); }
+
+  void reset(unsigned int i) { words[i / 64] &= ~bit(i); }
+
+  void assign(unsigned int i, bool value) {
+    if (value)
+      set(i);
+    else
+      reset(i);
+  }
+
+  bool test(unsigned int i) const { return (words[i / 64] & bit(i)) != 0; }
+
+  void clear() {
+    for (unsigned int w = 0; w < WORDS; w++) words[w] = 0;
+  }
+
+  bool any() const {
+    for (unsigned int w = 0; w < WORDS; w++)
+      if (words[w]) return true;
+    return false;
+  }
+
+  unsigned int count() const {
+    unsigned int n = 0;
+    for (unsigned int w = 0; w < WORDS; w++) n += std::popcount(words[w]);
+    return n;
+  }
+
+  BitSet operator|(const BitSet &o) const {
+    BitSet r;
+    for (unsigned int w = 0; w < WORDS; w++) r.words[w] = words[w] | o.words[w];
+    return r;
+  }
+
+  BitSet operator&(const BitSet &o) const {
+    BitSet r;
+    for (unsigned int w = 0; w < WORDS; w++) r.words[w] = words[w] & o.words[w];
+    return r;
+  }
+
+  // this & ~o, the common "held but not released" style query
+  BitSet without(const BitSet &o) const {
+    BitSet r;
+    for (unsigned int w = 0; w < WORDS; w++)
+      r.words[w] = words[w] & ~o.words[w];
+    return r;
+  }
+
+  bool operator==(const BitSet &o) const {
+    for (unsigned int w = 0; w < WORDS; w++)
+      if (words[w] != o.words[w]) return false;
+    return true;
+  }
+
+  // calls f(index) for every set bit, in ascending order
+  template <typename F>
+  void for_each(F &&f) const {
+    for (unsigned int w = 0; w < WORDS; w++) {
+      for (uint64_t bits = words[w]; bits; bits &= bits - 1)
+        f(w * 64 + std::countr_zero(bits));
+    }
+  }
+};
+
+typedef BitSet<NNOTES> NoteSet;
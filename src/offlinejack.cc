@@ -0,0 +1,529 @@
+#include "offlinejack.hh"
+
+#include <errno.h>
+#include <math.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+#include <jack/transport.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+// the most MIDI data a port buffer holds per period, however long it is
+#define MIDI_BUFFER_SIZE 32768
+
+/*
+ * jackd's MIDI port buffers are as big as audio ones, a float per frame, and
+ * every event takes a header, plus its data unless that fits in the header.
+ * Buffers here run out of room exactly as early, so overflow reproduces.
+ */
+#define MIDI_BUFFER_HEADER 24
+#define MIDI_EVENT_HEADER 8
+#define MIDI_INLINE_DATA 4
+
+struct MidiBuffer {
+  jack_nframes_t nframes = 0;
+  size_t nevents = 0;
+  // bytes of data stored, and bytes of the port buffer left
+  size_t used = 0;
+  size_t space = 0;
+  uint32_t lost = 0;
+  // allocated once, so the process callback never allocates
+  std::vector<jack_midi_event_t> events =
+      std::vector<jack_midi_event_t>(MIDI_BUFFER_SIZE);
+  std::vector<jack_midi_data_t> data =
+      std::vector<jack_midi_data_t>(MIDI_BUFFER_SIZE);
+};
+
+struct _jack_port {
+  jack_client_t *client;
+  std::string name;
+  unsigned long flags;
+  MidiBuffer buffer;
+};
+
+struct _jack_client {
+  std::string name;
+  bool active = false;
+  JackProcessCallback process = NULL;
+  void *process_arg = NULL;
+  JackGraphOrderCallback graph_order = NULL;
+  void *graph_order_arg = NULL;
+  std::vector<jack_port_t *> ports;
+};
+
+namespace offline_jack {
+
+static Config config;
+static std::vector<jack_client_t *> clients;
+static std::vector<Event> script;
+static std::vector<Event> output;
+static jack_nframes_t cycle_start = 0;
+// length of the last cycle run, 0 before the first
+static jack_nframes_t cycle_length = 0;
+static jack_nframes_t frame_offset = 0;
+static Transport transport;
+
+// ticks per beat in positions reported, as jackd's timebase masters use
+#define TICKS_PER_BEAT 1920.0
+
+void configure(const Config &new_config) {
+  config = new_config;
+  transport = {};
+  script.clear();
+  output.clear();
+  cycle_start = 0;
+  cycle_length = 0;
+  frame_offset = 0;
+}
+
+void script_input(const std::vector<Event> &events) {
+  script.insert(script.end(), events.begin(), events.end());
+  std::stable_sort(script.begin(), script.end(),
+                   [](const Event &a, const Event &b) {
+                     return (a.time < b.time);
+                   });
+}
+
+void set_transport(const Transport &new_transport) {
+  transport = new_transport;
+}
+
+void set_frame_offset(jack_nframes_t frames) { frame_offset = frames; }
+
+jack_nframes_t last_frame_time() { return (cycle_start); }
+
+std::vector<Event> take_output() { return (std::exchange(output, {})); }
+
+static void clear_buffer(MidiBuffer &buffer, jack_nframes_t nframes) {
+  size_t size = std::min<size_t>(nframes * sizeof(float), MIDI_BUFFER_SIZE);
+
+  buffer.nframes = nframes;
+  buffer.nevents = 0;
+  buffer.used = 0;
+  buffer.space = size > MIDI_BUFFER_HEADER ? size - MIDI_BUFFER_HEADER : 0;
+  buffer.lost = 0;
+}
+
+static void fill_input(MidiBuffer &buffer, jack_nframes_t start,
+                       jack_nframes_t nframes) {
+  for (const Event &event : script) {
+    if (event.time < start) continue;
+    if (event.time >= start + nframes) break;
+
+    jack_midi_data_t *data = jack_midi_event_reserve(
+        &buffer, event.time - start, event.data.size());
+    if (data != NULL) memcpy(data, event.data.data(), event.data.size());
+  }
+}
+
+static void capture_output(const MidiBuffer &buffer, jack_nframes_t start) {
+  for (size_t i = 0; i < buffer.nevents; i++) {
+    const jack_midi_event_t &event = buffer.events[i];
+
+    output.push_back({start + event.time, std::vector<jack_midi_data_t>(
+                                              event.buffer,
+                                              event.buffer + event.size)});
+  }
+}
+
+void run(size_t cycles) {
+  const jack_nframes_t nframes = config.buffer_size;
+
+  for (size_t cycle = 0; cycle < cycles; cycle++) {
+    cycle_start += cycle_length;
+    cycle_length = nframes;
+
+    for (jack_client_t *client : clients) {
+      if (!client->active || client->process == NULL) continue;
+
+      for (jack_port_t *port : client->ports) {
+        clear_buffer(port->buffer, nframes);
+        if (port->flags & JackPortIsInput)
+          fill_input(port->buffer, cycle_start, nframes);
+      }
+
+      client->process(nframes, client->process_arg);
+
+      for (jack_port_t *port : client->ports)
+        if (port->flags & JackPortIsOutput)
+          capture_output(port->buffer, cycle_start);
+    }
+
+    // scripted events are only delivered once
+    std::erase_if(script, [=](const Event &event) {
+      return (event.time < cycle_start + nframes);
+    });
+  }
+}
+
+}  // namespace offline_jack
+
+using namespace offline_jack;
+
+extern "C" {
+
+jack_client_t *jack_client_open(const char *client_name,
+                                jack_options_t options, jack_status_t *status,
+                                ...) {
+  jack_client_t *client = new jack_client_t;
+
+  client->name = client_name;
+  clients.push_back(client);
+
+  if (status != NULL) *status = (jack_status_t)0;
+
+  return (client);
+}
+
+int jack_client_close(jack_client_t *client) {
+  std::erase(clients, client);
+
+  for (jack_port_t *port : client->ports) delete port;
+  delete client;
+
+  return (0);
+}
+
+int jack_set_process_callback(jack_client_t *client,
+                              JackProcessCallback callback, void *arg) {
+  if (client->active) return (-1);
+
+  client->process = callback;
+  client->process_arg = arg;
+
+  return (0);
+}
+
+int jack_set_graph_order_callback(jack_client_t *client,
+                                  JackGraphOrderCallback callback, void *arg) {
+  if (client->active) return (-1);
+
+  client->graph_order = callback;
+  client->graph_order_arg = arg;
+
+  return (0);
+}
+
+int jack_activate(jack_client_t *client) {
+  client->active = true;
+
+  // as jackd does, the new client changes the graph
+  if (client->graph_order != NULL) client->graph_order(client->graph_order_arg);
+
+  return (0);
+}
+
+int jack_deactivate(jack_client_t *client) {
+  client->active = false;
+
+  return (0);
+}
+
+char *jack_get_client_name(jack_client_t *client) {
+  return (const_cast<char *>(client->name.c_str()));
+}
+
+jack_nframes_t jack_get_sample_rate(jack_client_t *client) {
+  return (config.sample_rate);
+}
+
+jack_nframes_t jack_get_buffer_size(jack_client_t *client) {
+  return (config.buffer_size);
+}
+
+jack_nframes_t jack_frame_time(const jack_client_t *client) {
+  return (cycle_start + frame_offset);
+}
+
+jack_nframes_t jack_last_frame_time(const jack_client_t *client) {
+  return (cycle_start);
+}
+
+jack_transport_state_t jack_transport_query(const jack_client_t *client,
+                                            jack_position_t *pos) {
+  double beats, ticks;
+
+  if (pos != NULL) memset(pos, 0, sizeof(*pos));
+
+  if (!transport.rolling) return (JackTransportStopped);
+  if (pos == NULL) return (JackTransportRolling);
+
+  pos->frame_rate = config.sample_rate;
+  pos->frame = cycle_start - transport.start;
+  pos->valid = JackPositionBBT;
+  pos->beats_per_bar = transport.beats_per_bar;
+  pos->beat_type = transport.beat_type;
+  pos->ticks_per_beat = TICKS_PER_BEAT;
+  pos->beats_per_minute = transport.beats_per_minute;
+
+  beats = pos->frame * transport.beats_per_minute / 60.0 / config.sample_rate;
+  ticks = floor(beats * TICKS_PER_BEAT);
+  pos->bar = ticks / (TICKS_PER_BEAT * transport.beats_per_bar) + 1;
+  pos->beat = fmod(ticks / TICKS_PER_BEAT, transport.beats_per_bar) + 1;
+  pos->tick = fmod(ticks, TICKS_PER_BEAT);
+  pos->bar_start_tick =
+      (pos->bar - 1) * transport.beats_per_bar * TICKS_PER_BEAT;
+
+  return (JackTransportRolling);
+}
+
+jack_port_t *jack_port_register(jack_client_t *client, const char *port_name,
+                                const char *port_type, unsigned long flags,
+                                unsigned long buffer_size) {
+  if (strcmp(port_type, JACK_DEFAULT_MIDI_TYPE) != 0) return (NULL);
+
+  jack_port_t *port = new jack_port_t;
+
+  port->client = client;
+  port->name = client->name + ":" + port_name;
+  port->flags = flags;
+  client->ports.push_back(port);
+
+  return (port);
+}
+
+void *jack_port_get_buffer(jack_port_t *port, jack_nframes_t nframes) {
+  return (&port->buffer);
+}
+
+const char *jack_port_name(const jack_port_t *port) {
+  return (port->name.c_str());
+}
+
+// there is nothing else to connect to
+
+int jack_port_connected(const jack_port_t *port) { return (0); }
+
+const char **jack_port_get_connections(const jack_port_t *port) {
+  return (NULL);
+}
+
+const char **jack_get_ports(jack_client_t *client, const char *port_name,
+                            const char *type_name, unsigned long flags) {
+  return (NULL);
+}
+
+int jack_connect(jack_client_t *client, const char *source_port,
+                 const char *destination_port) {
+  return (-1);
+}
+
+int jack_port_disconnect(jack_client_t *client, jack_port_t *port) {
+  return (0);
+}
+
+void jack_free(void *ptr) { free(ptr); }
+
+uint32_t jack_midi_get_event_count(void *port_buffer) {
+  return (static_cast<MidiBuffer *>(port_buffer)->nevents);
+}
+
+int jack_midi_event_get(jack_midi_event_t *event, void *port_buffer,
+                        uint32_t event_index) {
+  MidiBuffer *buffer = static_cast<MidiBuffer *>(port_buffer);
+
+  if (event_index >= buffer->nevents) return (ENODATA);
+
+  *event = buffer->events[event_index];
+
+  return (0);
+}
+
+void jack_midi_clear_buffer(void *port_buffer) {
+  MidiBuffer *buffer = static_cast<MidiBuffer *>(port_buffer);
+
+  clear_buffer(*buffer, buffer->nframes);
+}
+
+size_t jack_midi_max_event_size(void *port_buffer) {
+  MidiBuffer *buffer = static_cast<MidiBuffer *>(port_buffer);
+
+  if (buffer->space <= MIDI_EVENT_HEADER) return (0);
+
+  return (buffer->space - MIDI_EVENT_HEADER);
+}
+
+/* Like jackd, refuses events out of order or outside the period. */
+jack_midi_data_t *jack_midi_event_reserve(void *port_buffer,
+                                          jack_nframes_t time,
+                                          size_t data_size) {
+  MidiBuffer *buffer = static_cast<MidiBuffer *>(port_buffer);
+  size_t cost =
+      MIDI_EVENT_HEADER + (data_size > MIDI_INLINE_DATA ? data_size : 0);
+
+  if (time >= buffer->nframes ||
+      (buffer->nevents > 0 &&
+       time < buffer->events[buffer->nevents - 1].time) ||
+      data_size == 0 || cost > buffer->space) {
+    buffer->lost++;
+    return (NULL);
+  }
+
+  jack_midi_event_t &event = buffer->events[buffer->nevents++];
+
+  event.time = time;
+  event.size = data_size;
+  event.buffer = &buffer->data[buffer->used];
+  buffer->used += data_size;
+  buffer->space -= cost;
+
+  return (event.buffer);
+}
+
+int jack_midi_event_write(void *port_buffer, jack_nframes_t time,
+                          const jack_midi_data_t *data, size_t data_size) {
+  jack_midi_data_t *buffer =
+      jack_midi_event_reserve(port_buffer, time, data_size);
+
+  if (buffer == NULL) return (ENOBUFS);
+
+  memcpy(buffer, data, data_size);
+
+  return (0);
+}
+
+uint32_t jack_midi_get_lost_event_count(void *port_buffer) {
+  return (static_cast<MidiBuffer *>(port_buffer)->lost);
+}
+
+/*
+ * The ringbuffer is JACK's: a power of two sized buffer with one byte kept
+ * free, a single reader and a single writer.  The pointers are published
+ * with release stores, so it is as safe across threads as the real one.
+ */
+
+static size_t load(const volatile size_t &ptr) {
+  return (__atomic_load_n(&ptr, __ATOMIC_ACQUIRE));
+}
+
+static void store(volatile size_t &ptr, size_t value) {
+  __atomic_store_n(&ptr, value, __ATOMIC_RELEASE);
+}
+
+jack_ringbuffer_t *jack_ringbuffer_create(size_t sz) {
+  jack_ringbuffer_t *rb;
+  size_t size = 1;
+
+  while (size < sz) size <<= 1;
+
+  rb = (jack_ringbuffer_t *)malloc(sizeof(*rb));
+  if (rb == NULL) return (NULL);
+
+  rb->buf = (char *)malloc(size);
+  if (rb->buf == NULL) {
+    free(rb);
+    return (NULL);
+  }
+
+  rb->size = size;
+  rb->size_mask = size - 1;
+  rb->write_ptr = 0;
+  rb->read_ptr = 0;
+  rb->mlocked = 0;
+
+  return (rb);
+}
+
+void jack_ringbuffer_free(jack_ringbuffer_t *rb) {
+  free(rb->buf);
+  free(rb);
+}
+
+// nothing to lock, offline runs are not realtime
+int jack_ringbuffer_mlock(jack_ringbuffer_t *rb) {
+  rb->mlocked = 1;
+
+  return (0);
+}
+
+void jack_ringbuffer_reset(jack_ringbuffer_t *rb) {
+  rb->read_ptr = 0;
+  rb->write_ptr = 0;
+}
+
+size_t jack_ringbuffer_read_space(const jack_ringbuffer_t *rb) {
+  return ((load(rb->write_ptr) - load(rb->read_ptr)) & rb->size_mask);
+}
+
+size_t jack_ringbuffer_write_space(const jack_ringbuffer_t *rb) {
+  return ((load(rb->read_ptr) - load(rb->write_ptr) - 1) & rb->size_mask);
+}
+
+void jack_ringbuffer_get_read_vector(const jack_ringbuffer_t *rb,
+                                     jack_ringbuffer_data_t *vec) {
+  size_t r = load(rb->read_ptr);
+  size_t free_cnt = jack_ringbuffer_read_space(rb);
+  size_t end = r + free_cnt;
+
+  if (end > rb->size) {
+    vec[0] = {&rb->buf[r], rb->size - r};
+    vec[1] = {rb->buf, end & rb->size_mask};
+  } else {
+    vec[0] = {&rb->buf[r], free_cnt};
+    vec[1] = {rb->buf, 0};
+  }
+}
+
+void jack_ringbuffer_get_write_vector(const jack_ringbuffer_t *rb,
+                                      jack_ringbuffer_data_t *vec) {
+  size_t w = load(rb->write_ptr);
+  size_t free_cnt = jack_ringbuffer_write_space(rb);
+  size_t end = w + free_cnt;
+
+  if (end > rb->size) {
+    vec[0] = {&rb->buf[w], rb->size - w};
+    vec[1] = {rb->buf, end & rb->size_mask};
+  } else {
+    vec[0] = {&rb->buf[w], free_cnt};
+    vec[1] = {rb->buf, 0};
+  }
+}
+
+size_t jack_ringbuffer_peek(jack_ringbuffer_t *rb, char *dest, size_t cnt) {
+  jack_ringbuffer_data_t vec[2];
+
+  jack_ringbuffer_get_read_vector(rb, vec);
+  cnt = std::min(cnt, vec[0].len + vec[1].len);
+
+  size_t first = std::min(cnt, vec[0].len);
+  memcpy(dest, vec[0].buf, first);
+  memcpy(dest + first, vec[1].buf, cnt - first);
+
+  return (cnt);
+}
+
+void jack_ringbuffer_read_advance(jack_ringbuffer_t *rb, size_t cnt) {
+  store(rb->read_ptr, (load(rb->read_ptr) + cnt) & rb->size_mask);
+}
+
+size_t jack_ringbuffer_read(jack_ringbuffer_t *rb, char *dest, size_t cnt) {
+  cnt = jack_ringbuffer_peek(rb, dest, cnt);
+  jack_ringbuffer_read_advance(rb, cnt);
+
+  return (cnt);
+}
+
+void jack_ringbuffer_write_advance(jack_ringbuffer_t *rb, size_t cnt) {
+  store(rb->write_ptr, (load(rb->write_ptr) + cnt) & rb->size_mask);
+}
+
+size_t jack_ringbuffer_write(jack_ringbuffer_t *rb, const char *src,
+                             size_t cnt) {
+  jack_ringbuffer_data_t vec[2];
+
+  jack_ringbuffer_get_write_vector(rb, vec);
+  cnt = std::min(cnt, vec[0].len + vec[1].len);
+
+  size_t first = std::min(cnt, vec[0].len);
+  memcpy(vec[0].buf, src, first);
+  memcpy(vec[1].buf, src + first, cnt - first);
+  jack_ringbuffer_write_advance(rb, cnt);
+
+  return (cnt);
+}
+
+}  // extern "C"
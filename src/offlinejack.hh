@@ -0,0 +1,79 @@
+#pragma once
+
+#include <jack/jack.h>
+
+#include <vector>
+
+/**
+ * A stand-in for the JACK server, for running the MIDI engine where there is
+ * no jackd and no audio hardware.  Linking jack-keyboard-offline instead of
+ * libjack provides the part of the JACK API jack-keyboard uses: clients,
+ * MIDI ports and their buffers, ringbuffers, frame time and the transport.
+ *
+ * Nothing runs on its own.  run() drives the process callbacks of active
+ * clients synchronously, one period after the other, feeding their input
+ * ports from scripted events and capturing what they write to their output
+ * ports, so timing is exact and every run is the same.
+ *
+ * The frame clock starts at 0.  Between cycles jack_last_frame_time() is the
+ * start of the last cycle run and jack_frame_time() is that plus the offset
+ * set with set_frame_offset(), as if called that far into the next period.
+ *
+ * Not thread safe; drive it from the thread that owns the clients.
+ */
+namespace offline_jack {
+
+struct Config {
+  jack_nframes_t sample_rate = 48000;
+  jack_nframes_t buffer_size = 256;
+};
+
+/**
+ * A transport rolling from frame start at a steady tempo, as a timebase
+ * master would report it.  Stopped, it reports no position.
+ */
+struct Transport {
+  bool rolling = false;
+  jack_nframes_t start = 0;
+  double beats_per_minute = 120.0;
+  float beats_per_bar = 4.0;
+  float beat_type = 4.0;
+};
+
+// a MIDI event at an absolute frame time
+struct Event {
+  jack_nframes_t time;
+  std::vector<jack_midi_data_t> data;
+};
+
+/**
+ * Sets the sample rate and period, and resets the frame clock, the script,
+ * the transport and the captured output.  Clients may be open, their
+ * callbacks just see the new values from the next cycle on.
+ */
+void configure(const Config& config);
+
+/**
+ * Events to arrive on every input port, in the period that contains their
+ * time.  Added to what is already scripted; need not be in order.
+ */
+void script_input(const std::vector<Event>& events);
+
+void set_transport(const Transport& transport);
+
+// frames between the start of the last cycle and jack_frame_time()
+void set_frame_offset(jack_nframes_t frames);
+
+// runs the process callback of every active client for cycles periods
+void run(size_t cycles);
+
+// start of the last cycle run, 0 before the first
+jack_nframes_t last_frame_time();
+
+/**
+ * Everything written to output ports since the last call, in order, with
+ * the cycle start added to each event's offset.
+ */
+std::vector<Event> take_output();
+
+}  // namespace offline_jack
@@ -47,7 +47,6 @@
 #include <string.h>
 
 #include <iostream>
-#include <unordered_map>
 // using easy keyboard because eventually I want to be able to bind to
 // chord or arpeggiator, as well as note
 #include "easycsv.hh"
@@ -60,288 +59,211 @@ enum { NOTE_ON_SIGNAL, NOTE_OFF_SIGNAL, LAST_SIGNAL };
 
 static guint piano_keyboard_signals[LAST_SIGNAL] = {0};
 
-static void draw_keyboard_cue(PianoKeyboard *pk) {
-  int w, h, first_note_in_lower_row, last_note_in_lower_row,
-      first_note_in_higher_row, last_note_in_higher_row;
+static GtkWidgetClass *parent_class = NULL;
 
-  GdkGC *gc;
+static gboolean frame_ready_async(gpointer data) {
+  gtk_widget_queue_draw(GTK_WIDGET(data));
+  g_object_unref(data);
 
-  w = pk->notes[0].w;
-  h = pk->notes[0].h;
+  return (FALSE);
+}
+
+/* Called on the render thread whenever a new frame is ready to be blitted. */
+static void frame_ready(void *data) {
+  g_object_ref(data);
+  g_idle_add(frame_ready_async, data);
+}
+
+/*
+ * Hands the current state of the keyboard to the render thread.  This only
+ * copies the state; painting happens elsewhere, so handling input never
+ * waits for it.
+ */
+static void queue_redraw(PianoKeyboard *pk) {
+  KeyboardFrame frame;
+
+  if (pk->renderer == NULL) return;
 
-  gc = GTK_WIDGET(pk)->style->fg_gc[0];
+  frame.width = GTK_WIDGET(pk)->allocation.width;
+  frame.height = GTK_WIDGET(pk)->allocation.height;
+  frame.min_note = pk->min_note;
+  frame.max_note = pk->max_note;
+  frame.lit = pk->pressed | pk->sustained;
+  memcpy(frame.velocity, pk->velocity, sizeof(frame.velocity));
+  memcpy(frame.geometry, pk->geometry, sizeof(frame.geometry));
+  frame.enable_keyboard_cue = pk->enable_keyboard_cue;
+  frame.octave = pk->octave;
+
+  pk->renderer->request(frame);
+}
 
-  first_note_in_lower_row = (pk->octave + 5) * 12;
-  last_note_in_lower_row = (pk->octave + 6) * 12 - 1;
-  first_note_in_higher_row = (pk->octave + 6) * 12;
-  last_note_in_higher_row = (pk->octave + 7) * 12 + 4;
+/* Returns 1 if source was the first one to hold the note down. */
+static int hold_note(PianoKeyboard *pk, int key, enum NoteSource source) {
+  if (source != NOTE_SOURCE_KEYBOARD && pk->held_by[source].test(key))
+    return (0);
 
-  gdk_draw_line(GTK_WIDGET(pk)->window, gc,
-                pk->notes[first_note_in_lower_row].x + 3, h - 6,
-                pk->notes[last_note_in_lower_row].x + w - 3, h - 6);
+  pk->held_by[source].set(key);
 
-  gdk_draw_line(GTK_WIDGET(pk)->window, gc,
-                pk->notes[first_note_in_higher_row].x + 3, h - 9,
-                pk->notes[last_note_in_higher_row].x + w - 3, h - 9);
+  return (pk->holders[key]++ == 0);
 }
 
-static void draw_note(PianoKeyboard *pk, int note) {
-  GtkWidget *widget = GTK_WIDGET(pk);
-  if (note < pk->min_note) return;
-  if (note > pk->max_note) return;
-  int is_white, x, w, h, pressed;
+/* Returns 1 if source was the last one holding the note down. */
+static int unhold_note(PianoKeyboard *pk, int key, enum NoteSource source) {
+  if (source != NOTE_SOURCE_KEYBOARD) {
+    if (!pk->held_by[source].test(key)) return (0);
+    pk->held_by[source].reset(key);
+  }
 
-  is_white = pk->notes[note].white;
+  if (pk->holders[key] == 0) return (0);
 
-  x = pk->notes[note].x;
-  w = pk->notes[note].w;
-  h = pk->notes[note].h;
+  if (--pk->holders[key] > 0) {
+    if (source == NOTE_SOURCE_KEYBOARD) {
+      /* Still held by another key bound to the same note? */
+      int held = 0;
 
-  pressed = (int)(pk->notes[note].pressed || pk->notes[note].sustained);
+      pk->keys_down.for_each([pk, key, &held](int k) {
+        if (pk->key_note[k] == key) held = 1;
+      });
+      pk->held_by[NOTE_SOURCE_KEYBOARD].assign(key, held);
+    }
 
-  if (is_white) {
-    piano_keyboard_draw_white_key(widget, x, 0, w, h, pressed,
-                                  pk->notes[note].velocity);
-  } else {
-    piano_keyboard_draw_black_key(widget, x, 0, w, h, pressed,
-                                  pk->notes[note].velocity);
+    return (0);
   }
 
-  if (note < NNOTES - 2 && !pk->notes[note + 1].white) draw_note(pk, note + 1);
+  pk->held_by[NOTE_SOURCE_KEYBOARD].reset(key);
 
-  if (note > 0 && !pk->notes[note - 1].white) draw_note(pk, note - 1);
+  return (1);
+}
 
-  if (pk->enable_keyboard_cue) draw_keyboard_cue(pk);
+/* Drops every holder of the given notes, e.g. when they are cut off. */
+static void forget_holders(PianoKeyboard *pk, const NoteSet &notes) {
+  for (int source = 0; source < NOTE_SOURCES; source++)
+    pk->held_by[source] = pk->held_by[source].without(notes);
 
-  /*
-   * XXX: This doesn't really belong here.  Originally I wanted to pack
-   * PianoKeyboard into GtkFrame packed into GtkAlignment.  I failed to make it
-   * behave the way I want.  GtkFrame would need to adapt to the "proper" size
-   * of PianoKeyboard, i.e. to the useful_width, not allocated width; that
-   * didn't work.
-   */
-  widget = GTK_WIDGET(pk);
-  gtk_paint_shadow(widget->style, widget->window, GTK_STATE_NORMAL,
-                   GTK_SHADOW_IN, NULL, widget, NULL, pk->widget_margin, 0,
-                   widget->allocation.width - pk->widget_margin * 2 + 1,
-                   widget->allocation.height);
+  notes.for_each([pk](int i) { pk->holders[i] = 0; });
+
+  pk->keys_down.for_each([pk, &notes](int k) {
+    if (notes.test(pk->key_note[k])) pk->keys_down.reset(k);
+  });
 }
 
-static int press_key(PianoKeyboard *pk, int key) {
+static int press_key(PianoKeyboard *pk, int key, enum NoteSource source) {
   assert(key >= 0);
   assert(key < NNOTES);
 
   pk->maybe_stop_sustained_notes = 0;
 
-  /* This is for keyboard autorepeat protection. */
-  if (pk->notes[key].pressed) return (0);
-
-  if (pk->sustain_new_notes)
-    pk->notes[key].sustained = 1;
-  else
-    pk->notes[key].sustained = 0;
+  /* Somebody else is already holding it down. */
+  if (!hold_note(pk, key, source)) return (0);
 
-  pk->notes[key].pressed = 1;
-  pk->notes[key].velocity = pk->current_velocity;
+  pk->sustained.assign(key, pk->sustain_new_notes);
+  pk->pressed.set(key);
+  pk->velocity[key] = pk->current_velocity;
 
   g_signal_emit_by_name(GTK_WIDGET(pk), "note-on", key);
-  draw_note(pk, key);
+  queue_redraw(pk);
 
   return (1);
 }
 
-static int release_key(PianoKeyboard *pk, int key) {
+static int release_key(PianoKeyboard *pk, int key, enum NoteSource source) {
   assert(key >= 0);
   assert(key < NNOTES);
 
   pk->maybe_stop_sustained_notes = 0;
 
-  if (!pk->notes[key].pressed) return (0);
+  if (!unhold_note(pk, key, source)) return (0);
+
+  if (!pk->pressed.test(key)) return (0);
 
-  if (pk->sustain_new_notes) pk->notes[key].sustained = 1;
+  if (pk->sustain_new_notes) pk->sustained.set(key);
 
-  pk->notes[key].pressed = 0;
+  pk->pressed.reset(key);
 
-  if (pk->notes[key].sustained) return (0);
+  if (pk->sustained.test(key)) return (0);
 
   g_signal_emit_by_name(GTK_WIDGET(pk), "note-off", key);
-  draw_note(pk, key);
+  queue_redraw(pk);
 
   return (1);
 }
 
 static void stop_unsustained_notes(PianoKeyboard *pk) {
-  int i;
+  NoteSet stopped = pk->pressed.without(pk->sustained);
 
-  for (i = 0; i < NNOTES; i++) {
-    if (pk->notes[i].pressed && !pk->notes[i].sustained) {
-      pk->notes[i].pressed = 0;
-      g_signal_emit_by_name(GTK_WIDGET(pk), "note-off", i);
-      draw_note(pk, i);
-    }
-  }
-}
+  pk->pressed = pk->pressed.without(stopped);
+  forget_holders(pk, stopped);
 
-static void stop_sustained_notes(PianoKeyboard *pk) {
-  int i;
-
-  for (i = 0; i < NNOTES; i++) {
-    if (pk->notes[i].sustained) {
-      pk->notes[i].pressed = 0;
-      pk->notes[i].sustained = 0;
-      g_signal_emit_by_name(GTK_WIDGET(pk), "note-off", i);
-      draw_note(pk, i);
-    }
-  }
-}
+  stopped.for_each([pk](int i) {
+    g_signal_emit_by_name(GTK_WIDGET(pk), "note-off", i);
+  });
 
-static int key_binding(PianoKeyboard *pk, guint16 key) {
-  assert(pk->key_bindings != NULL);
+  if (stopped.any()) queue_redraw(pk);
+}
 
-  if (key >= pk->key_bindings->len) return (0);
+static void stop_sustained_notes(PianoKeyboard *pk) {
+  NoteSet stopped = pk->sustained;
 
-  return (g_array_index(pk->key_bindings, int, key));
-}
+  pk->pressed = pk->pressed.without(stopped);
+  pk->sustained.clear();
+  forget_holders(pk, stopped);
 
-static void bind_key(PianoKeyboard *pk, guint key, int note) {
-  assert(pk->key_bindings != NULL);
+  stopped.for_each([pk](int i) {
+    g_signal_emit_by_name(GTK_WIDGET(pk), "note-off", i);
+  });
 
-  if (key >= pk->key_bindings->len) g_array_set_size(pk->key_bindings, key + 1);
-  g_array_index(pk->key_bindings, int, key) = note;
+  if (stopped.any()) queue_redraw(pk);
 }
 
-static void clear_notes(PianoKeyboard *pk) {
+static int key_binding(PianoKeyboard *pk, guint16 key) {
   assert(pk->key_bindings != NULL);
 
-  g_array_set_size(pk->key_bindings, 0);
-}
-
-static void bind_keys_qwerty(PianoKeyboard *pk) {
-  clear_notes(pk);
-  std::string homedir = getenv("HOME");
-  if (auto p{CSVParser::create(0)}; !p) {
-    std::cerr << "Failed to initialize csv parser\n";
-    return;
-  } else {
-    // read in the keymap file, and put it into the qwerty_map
-    // which has pairs like
-    // {"KEYBOARD_KEY_NAME (like 'Escape')": KEY_CODE (like 9)}
-    std::string filename = homedir + "/.jack-keyboard/boards/qwerty.csv";
-
-    FILE *fp = fopen(filename.c_str(), "rb");
-    if (!fp) {
-      std::cout << "Failed to open " << filename << ": " << strerror(errno)
-                << "\n";
-      return;
-    }
-
-    if (ferror(fp)) {
-      std::cerr << "Error while reading file " << filename << "\n";
-      fclose(fp);
-      return;
-    }
-
-    std::unordered_map<std::string, int> qwerty_map;
-
-    enum KeyMap { code, name };
-    // iterate throught the rows of the keycode definitions file
-    p->readFile(fp, std::vector<std::string>{"code", "name"},
-                [&qwerty_map](const std::vector<std::string> &row) {
-                  // for each row, attempt to parse the keycode to an int
-                  if (auto code{parse_int(row[KeyMap::code])}; code) {
-                    // set the key's name to return the key's code
-                    qwerty_map[row[KeyMap::name]] = code.value();
-                  }
-                });
-
-    fclose(fp);
-
-    // read in the map of keys to midi notes
-    // and bind those key codes to the midi note value
-    filename = homedir + "/.jack-keyboard/bindings/keymap.csv";
-    fp = fopen(filename.c_str(), "rb");
-    if (!fp) {
-      std::cout << "Failed to open " << filename << ": " << strerror(errno)
-                << "\n";
-      return;
-    }
-
-    if (ferror(fp)) {
-      std::cerr << "Error while reading file " << filename << "\n";
-      fclose(fp);
-      return;
-    }
-
-    enum MidiMap { key, note };
-    // iterate through rows of keymap file
-    p->readFile(fp, std::vector<std::string>{"key", "note"},
-                [&qwerty_map, &pk](const std::vector<std::string> &row) {
-                  // std::cout << row[0] << " -> " << row[1] << std::endl;
-                  // std::cout << qwerty_map[row[0]] << " -> "
-                  //<< string_to_midi(row[1]) << std::endl;
-
-                  //  parse the key into keycode using qwerty_map
-                  //  parse the midi note to midi value using string_to_midi
-                  //  bind the key code to trigger that midi note
-                  bind_key(pk, qwerty_map[row[MidiMap::key]],
-                           string_to_midi(row[MidiMap::note]));
-                });
-    fclose(fp);
-  }
+  return (pk->key_bindings->lookup(key));
 }
 
 static gint keyboard_event_handler(GtkWidget *mk, GdkEventKey *event,
                                    gpointer notused) {
   int note;
+  guint16 keycode = event->hardware_keycode;
   PianoKeyboard *pk = PIANO_KEYBOARD(mk);
 
-  note = key_binding(pk, event->hardware_keycode);
+  note = key_binding(pk, keycode);
 
-  if (note <= 0) {
+  if (note <= 0 || keycode >= NKEYCODES) {
     /* Key was not bound.  Maybe it's one of the keys handled in
      * jack-keyboard.c. */
     return (FALSE);
   }
 
-  note += pk->octave * 12;
+  if (event->type == GDK_KEY_PRESS) {
+    /* This is for keyboard autorepeat protection. */
+    if (pk->keys_down.test(keycode)) return (TRUE);
 
-  // note was bound, but we're beyond the midi spec, cannot play.
-  if (note < 0 || note >= NNOTES) {
-    return (TRUE);
-  }
+    note += pk->octave * 12;
 
-  if (event->type == GDK_KEY_PRESS) {
-    press_key(pk, note);
+    // note was bound, but we're beyond the midi spec, cannot play.
+    if (note < 0 || note >= NNOTES) {
+      return (TRUE);
+    }
+
+    /* Remember the note, the octave may change before the key goes up. */
+    pk->keys_down.set(keycode);
+    pk->key_note[keycode] = note;
+    press_key(pk, note, NOTE_SOURCE_KEYBOARD);
 
   } else if (event->type == GDK_KEY_RELEASE) {
-    release_key(pk, note);
+    if (!pk->keys_down.test(keycode)) return (TRUE);
+
+    pk->keys_down.reset(keycode);
+    release_key(pk, pk->key_note[keycode], NOTE_SOURCE_KEYBOARD);
   }
 
   return (TRUE);
 }
 
 static int get_note_for_xy(PianoKeyboard *pk, int x, int y) {
-  int height, note;
-
-  height = GTK_WIDGET(pk)->allocation.height;
-
-  if (y <= ((height * 2) / 3)) { /* might be a black key */
-    for (note = 0; note <= pk->max_note; ++note) {
-      if (pk->notes[note].white) continue;
-
-      if (x >= pk->notes[note].x && x <= pk->notes[note].x + pk->notes[note].w)
-        return (note);
-    }
-  }
-
-  for (note = 0; note <= pk->max_note; ++note) {
-    if (!pk->notes[note].white) continue;
-
-    if (x >= pk->notes[note].x && x <= pk->notes[note].x + pk->notes[note].w)
-      return (note);
-  }
-
-  return (-1);
+  return (note_at_xy(pk->geometry, pk->max_note,
+                     GTK_WIDGET(pk)->allocation.height, x, y));
 }
 
 static gboolean mouse_button_event_handler(PianoKeyboard *pk,
@@ -364,19 +286,16 @@ static gboolean mouse_button_event_handler(PianoKeyboard *pk,
     }
 
     if (pk->note_being_pressed_using_mouse >= 0)
-      release_key(pk, pk->note_being_pressed_using_mouse);
+      release_key(pk, pk->note_being_pressed_using_mouse, NOTE_SOURCE_MOUSE);
 
-    press_key(pk, note);
+    press_key(pk, note, NOTE_SOURCE_MOUSE);
     pk->note_being_pressed_using_mouse = note;
 
   } else if (event->type == GDK_BUTTON_RELEASE) {
-    if (note >= 0) {
-      release_key(pk, note);
-
-    } else {
-      if (pk->note_being_pressed_using_mouse >= 0)
-        release_key(pk, pk->note_being_pressed_using_mouse);
-    }
+    /* The mouse only ever holds the note it pressed last, whatever is under
+     * the pointer now. */
+    if (pk->note_being_pressed_using_mouse >= 0)
+      release_key(pk, pk->note_being_pressed_using_mouse, NOTE_SOURCE_MOUSE);
 
     pk->note_being_pressed_using_mouse = -1;
   }
@@ -395,8 +314,8 @@ static gboolean mouse_motion_event_handler(PianoKeyboard *pk,
 
   if (note != pk->note_being_pressed_using_mouse && note >= 0) {
     if (pk->note_being_pressed_using_mouse >= 0)
-      release_key(pk, pk->note_being_pressed_using_mouse);
-    press_key(pk, note);
+      release_key(pk, pk->note_being_pressed_using_mouse, NOTE_SOURCE_MOUSE);
+    press_key(pk, note, NOTE_SOURCE_MOUSE);
     pk->note_being_pressed_using_mouse = note;
   }
 
@@ -405,10 +324,25 @@ static gboolean mouse_motion_event_handler(PianoKeyboard *pk,
 
 static gboolean piano_keyboard_expose(GtkWidget *widget,
                                       GdkEventExpose *event) {
-  int i;
   PianoKeyboard *pk = PIANO_KEYBOARD(widget);
+  cairo_t *c = gdk_cairo_create(GDK_DRAWABLE(widget->window));
+
+  /* Nothing rendered yet; we will be called again once it is. */
+  if (pk->renderer == NULL || !pk->renderer->blit(c)) queue_redraw(pk);
 
-  for (i = 0; i < NNOTES; i++) draw_note(pk, i);
+  cairo_destroy(c);
+
+  /*
+   * XXX: This doesn't really belong here.  Originally I wanted to pack
+   * PianoKeyboard into GtkFrame packed into GtkAlignment.  I failed to make it
+   * behave the way I want.  GtkFrame would need to adapt to the "proper" size
+   * of PianoKeyboard, i.e. to the useful_width, not allocated width; that
+   * didn't work.
+   */
+  gtk_paint_shadow(widget->style, widget->window, GTK_STATE_NORMAL,
+                   GTK_SHADOW_IN, NULL, widget, NULL, pk->widget_margin, 0,
+                   widget->allocation.width - pk->widget_margin * 2 + 1,
+                   widget->allocation.height);
 
   return (TRUE);
 }
@@ -419,69 +353,10 @@ static void piano_keyboard_size_request(GtkWidget *widget,
   requisition->height = PIANO_KEYBOARD_DEFAULT_HEIGHT;
 }
 
-static int is_black(int key) {
-  int note_in_octave = key % 12;
-  if (note_in_octave == 1 || note_in_octave == 3 || note_in_octave == 6 ||
-      note_in_octave == 8 || note_in_octave == 10)
-    return 1;
-  return 0;
-}
-
-static double black_key_left_shift(int key) {
-  int note_in_octave = key % 12;
-  switch (note_in_octave) {
-    case 1:
-      return 2.0 / 3.0;
-    case 3:
-      return 1.0 / 3.0;
-    case 6:
-      return 2.0 / 3.0;
-    case 8:
-      return 0.5;
-    case 10:
-      return 1.0 / 3.0;
-    default:
-      return 0;
-  }
-  return 0;
-}
-
 static void recompute_dimensions(PianoKeyboard *pk) {
-  int number_of_white_keys = 0, skipped_white_keys = 0, key_width,
-      black_key_width, useful_width, note, white_key, width, height;
-
-  for (note = pk->min_note; note <= pk->max_note; ++note)
-    if (!is_black(note)) ++number_of_white_keys;
-  for (note = 0; note < pk->min_note; ++note)
-    if (!is_black(note)) ++skipped_white_keys;
-
-  width = GTK_WIDGET(pk)->allocation.width;
-  height = GTK_WIDGET(pk)->allocation.height;
-
-  key_width = width / number_of_white_keys;
-  black_key_width = key_width * 0.8;
-  useful_width = number_of_white_keys * key_width;
-  pk->widget_margin = (width - useful_width) / 2;
-
-  for (note = 0, white_key = -skipped_white_keys; note < NNOTES; note++) {
-    if (is_black(note)) {
-      /* This note is black key. */
-      pk->notes[note].x = pk->widget_margin + (white_key * key_width) -
-                          (black_key_width * black_key_left_shift(note));
-      pk->notes[note].w = black_key_width;
-      pk->notes[note].h = (height * 3) / 5;
-      pk->notes[note].white = 0;
-      continue;
-    }
-
-    /* This note is white key. */
-    pk->notes[note].x = pk->widget_margin + white_key * key_width;
-    pk->notes[note].w = key_width;
-    pk->notes[note].h = height;
-    pk->notes[note].white = 1;
-
-    white_key++;
-  }
+  pk->widget_margin = layout_note_geometry(
+      pk->geometry, pk->min_note, pk->max_note,
+      GTK_WIDGET(pk)->allocation.width, GTK_WIDGET(pk)->allocation.height);
 }
 
 static void piano_keyboard_size_allocate(GtkWidget *widget,
@@ -493,15 +368,29 @@ static void piano_keyboard_size_allocate(GtkWidget *widget,
   widget->allocation = *allocation;
 
   recompute_dimensions(PIANO_KEYBOARD(widget));
+  queue_redraw(PIANO_KEYBOARD(widget));
 
   if (GTK_WIDGET_REALIZED(widget))
     gdk_window_move_resize(widget->window, allocation->x, allocation->y,
                            allocation->width, allocation->height);
 }
 
+static void piano_keyboard_destroy(GtkObject *object) {
+  PianoKeyboard *pk = PIANO_KEYBOARD(object);
+
+  /* Joins the render thread, so no frame_ready() can come in after this. */
+  delete pk->renderer;
+  pk->renderer = NULL;
+
+  if (GTK_OBJECT_CLASS(parent_class)->destroy)
+    GTK_OBJECT_CLASS(parent_class)->destroy(object);
+}
+
 static void piano_keyboard_class_init(PianoKeyboardClass *klass) {
   GtkWidgetClass *widget_klass;
 
+  parent_class = (GtkWidgetClass *)g_type_class_peek_parent(klass);
+
   /* Set up signals. */
   piano_keyboard_signals[NOTE_ON_SIGNAL] = g_signal_new(
       "note-on", G_TYPE_FROM_CLASS(klass),
@@ -515,6 +404,8 @@ static void piano_keyboard_class_init(PianoKeyboardClass *klass) {
 
   widget_klass = (GtkWidgetClass *)klass;
 
+  GTK_OBJECT_CLASS(klass)->destroy = piano_keyboard_destroy;
+
   widget_klass->expose_event = piano_keyboard_expose;
   widget_klass->size_request = piano_keyboard_size_request;
   widget_klass->size_allocate = piano_keyboard_size_allocate;
@@ -559,6 +450,87 @@ GType piano_keyboard_get_type(void) {
   return (mk_type);
 }
 
+/* Names in bindings files that are not the name of their keysym. */
+static const struct {
+  const char *name;
+  const char *keysym;
+} key_name_aliases[] = {
+    {"Backspace", "BackSpace"}, {"CapsLock", "Caps_Lock"},
+    {"Shift", "Shift_L"},       {"Enter", "Return"},
+    {"Control", "Control_L"},   {"Alt", "Alt_L"},
+    {"Meta", "Meta_L"},         {"Super", "Super_L"},
+    {"ArrowUp", "Up"},          {"ArrowDown", "Down"},
+    {"ArrowLeft", "Left"},      {"ArrowRight", "Right"},
+};
+
+static guint key_name_to_keyval(std::string_view name) {
+  /* A single character, like "z", "," or "é", names the key typing it. */
+  gunichar c = g_utf8_get_char_validated(name.data(), name.length());
+  if (c != (gunichar)-1 && c != (gunichar)-2 &&
+      g_utf8_next_char(name.data()) == name.data() + name.length())
+    return (gdk_unicode_to_keyval(c));
+
+  std::string keysym{name};
+  for (const auto &alias : key_name_aliases) {
+    if (name == alias.name) {
+      keysym = alias.keysym;
+      break;
+    }
+  }
+
+  return (gdk_keyval_from_name(keysym.c_str()));
+}
+
+/*
+ * Finds the key typing a key name without modifiers in the keymap, so
+ * bindings follow the keyboard and layout X actually has rather than the key
+ * codes in the board files, which are only used for names this can't find.
+ */
+static int resolve_key_name(std::string_view name, void *data) {
+  GdkKeymap *keymap = (GdkKeymap *)data;
+  GdkKeymapKey *keys;
+  gint n_keys;
+  int keycode = -1;
+
+  guint keyval = key_name_to_keyval(name);
+  if (keyval == 0 || keyval == GDK_VoidSymbol) return (-1);
+
+  if (!gdk_keymap_get_entries_for_keyval(keymap, keyval, &keys, &n_keys))
+    return (-1);
+
+  for (int i = 0; i < n_keys; i++) {
+    if (keys[i].group == 0 && keys[i].level == 0) {
+      keycode = keys[i].keycode;
+      break;
+    }
+  }
+
+  g_free(keys);
+
+  return (keycode);
+}
+
+/*
+ * Emitted on MappingNotify and XKB keymap changes.  The loaded layouts are
+ * resolved again in place, so key_binding() stays a single lookup.
+ */
+static void keymap_keys_changed(GdkKeymap *keymap, gpointer notused) {
+  key_names_changed();
+}
+
+static void resolve_key_names_with_keymap(void) {
+  static gboolean done = FALSE;
+  GdkKeymap *keymap;
+
+  if (done) return;
+  done = TRUE;
+
+  keymap = gdk_keymap_get_default();
+  set_key_name_resolver(resolve_key_name, keymap);
+  g_signal_connect(G_OBJECT(keymap), "keys-changed",
+                   G_CALLBACK(keymap_keys_changed), NULL);
+}
+
 GtkWidget *piano_keyboard_new(void) {
   GtkWidget *widget;
   PianoKeyboard *pk;
@@ -571,18 +543,26 @@ GtkWidget *piano_keyboard_new(void) {
   pk->enable_keyboard_cue = 0;
   pk->octave = 4;
   pk->note_being_pressed_using_mouse = -1;
-  memset((void *)pk->notes, 0, sizeof(struct Note) * NNOTES);
-  /* 255 max unsigned char, thus max keycode we can bind */
-  pk->key_bindings = g_array_sized_new(FALSE, TRUE, sizeof(int), 255);
+  pk->pressed.clear();
+  pk->sustained.clear();
+  memset(pk->velocity, 0, sizeof(pk->velocity));
+  memset(pk->holders, 0, sizeof(pk->holders));
+  for (int source = 0; source < NOTE_SOURCES; source++)
+    pk->held_by[source].clear();
+  pk->keys_down.clear();
+  memset(pk->geometry, 0, sizeof(pk->geometry));
+  pk->renderer = new KeyboardRenderer(frame_ready, pk);
   pk->min_note = PIANO_MIN_NOTE;
   pk->max_note = PIANO_MAX_NOTE;
-  bind_keys_qwerty(pk);
+  resolve_key_names_with_keymap();
+  piano_keyboard_set_keyboard_layout(pk, "QWERTY");
 
   return (widget);
 }
 
 void piano_keyboard_set_keyboard_cue(PianoKeyboard *pk, int enabled) {
   pk->enable_keyboard_cue = enabled;
+  queue_redraw(pk);
 }
 
 void piano_keyboard_sustain_press(PianoKeyboard *pk) {
@@ -598,40 +578,70 @@ void piano_keyboard_sustain_release(PianoKeyboard *pk) {
   pk->sustain_new_notes = 0;
 }
 
-void piano_keyboard_set_note_on(PianoKeyboard *pk, int note, int vel) {
-  if (pk->notes[note].pressed == 0) {
-    pk->notes[note].pressed = 1;
-    pk->notes[note].velocity = vel;
-    draw_note(pk, note);
-  }
+/*
+ * Note on/off received over MIDI.  These do not emit signals; they return
+ * TRUE if the message should be passed on, i.e. MIDI was the first source to
+ * press the note, or nobody else holds the note it releases.
+ */
+gboolean piano_keyboard_set_note_on(PianoKeyboard *pk, int note, int vel) {
+  if (!hold_note(pk, note, NOTE_SOURCE_MIDI)) return (FALSE);
+
+  pk->pressed.set(note);
+  pk->velocity[note] = vel;
+  queue_redraw(pk);
+
+  return (TRUE);
 }
 
-void piano_keyboard_set_note_off(PianoKeyboard *pk, int note) {
-  if (pk->notes[note].pressed || pk->notes[note].sustained) {
-    pk->notes[note].pressed = 0;
-    pk->notes[note].sustained = 0;
-    draw_note(pk, note);
-  }
+gboolean piano_keyboard_set_note_off(PianoKeyboard *pk, int note) {
+  if (!pk->held_by[NOTE_SOURCE_MIDI].test(note))
+    return (pk->holders[note] == 0);
+
+  if (!unhold_note(pk, note, NOTE_SOURCE_MIDI)) return (FALSE);
+
+  pk->pressed.reset(note);
+  pk->sustained.reset(note);
+  queue_redraw(pk);
+
+  return (TRUE);
+}
+
+void piano_keyboard_set_all_notes_off(PianoKeyboard *pk) {
+  NoteSet sounding = pk->pressed | pk->sustained;
+
+  pk->pressed.clear();
+  pk->sustained.clear();
+  memset(pk->holders, 0, sizeof(pk->holders));
+  for (int source = 0; source < NOTE_SOURCES; source++)
+    pk->held_by[source].clear();
+  pk->keys_down.clear();
+
+  if (sounding.any()) queue_redraw(pk);
 }
 
 void piano_keyboard_set_octave(PianoKeyboard *pk, int octave) {
   stop_unsustained_notes(pk);
   pk->octave = octave;
-  gtk_widget_queue_draw(GTK_WIDGET(pk));
+  queue_redraw(pk);
 }
 
+/*
+ * Layouts are loaded once and kept, see find_key_layout(), so switching is
+ * just pointing at another table.  Keys already down keep playing the note
+ * they pressed.
+ */
 gboolean piano_keyboard_set_keyboard_layout(PianoKeyboard *pk,
                                             const char *layout) {
   assert(layout);
 
-  if (!strcasecmp(layout, "QWERTY")) {
-    bind_keys_qwerty(pk);
-
-  } else {
+  const KeyBindingTable *table = find_key_layout(layout);
+  if (table == NULL) {
     /* Unknown layout name. */
     return (TRUE);
   }
 
+  pk->key_bindings = table;
+
   return (FALSE);
 }
 
@@ -639,128 +649,5 @@ void piano_keyboard_enable_all_midi_notes(PianoKeyboard *pk) {
   pk->min_note = 0;
   pk->max_note = NNOTES - 1;
   recompute_dimensions(pk);
-}
-
-void piano_keyboard_draw_white_key(GtkWidget *widget, int x, int y, int w,
-                                   int h, int pressed, int vel) {
-  cairo_pattern_t *pat;
-  GdkWindow *window = widget->window;
-  cairo_t *c = gdk_cairo_create(GDK_DRAWABLE(window));
-  cairo_set_line_join(c, CAIRO_LINE_JOIN_MITER);
-  cairo_set_line_width(c, 1);
-
-  cairo_rectangle(c, x, y, w, h);
-  cairo_clip_preserve(c);
-
-  pat = cairo_pattern_create_linear(x, y, x, y + h);
-  cairo_pattern_add_color_stop_rgb(pat, 0.0, 0.25, 0.25, 0.2);
-  cairo_pattern_add_color_stop_rgb(pat, 0.1, 0.957, 0.914, 0.925);
-  cairo_pattern_add_color_stop_rgb(pat, 1.0, 0.796, 0.787, 0.662);
-  cairo_set_source(c, pat);
-  cairo_fill(c);
-
-  cairo_move_to(c, x + 0.5, y);
-  cairo_line_to(c, x + 0.5, y + h);
-  cairo_set_source_rgba(c, 1, 1, 1, 0.75);
-  cairo_stroke(c);
-
-  cairo_move_to(c, x + w - 0.5, y);
-  cairo_line_to(c, x + w - 0.5, y + h);
-  cairo_set_source_rgba(c, 0, 0, 0, 0.5);
-  cairo_stroke(c);
-
-  if (pressed) piano_keyboard_draw_pressed(c, x, y, w, h, vel);
-
-  piano_keyboard_draw_key_shadow(c, x, y, w, h);
-
-  cairo_destroy(c);
-}
-
-void piano_keyboard_draw_black_key(GtkWidget *widget, int x, int y, int w,
-                                   int h, int pressed, int vel) {
-  cairo_pattern_t *pat;
-  GdkWindow *window = widget->window;
-  cairo_t *c = gdk_cairo_create(GDK_DRAWABLE(window));
-  cairo_set_line_join(c, CAIRO_LINE_JOIN_MITER);
-  cairo_set_line_width(c, 1);
-
-  cairo_rectangle(c, x, y, w, h);
-  cairo_clip_preserve(c);
-
-  pat = cairo_pattern_create_linear(x, y, x, y + h);
-  cairo_pattern_add_color_stop_rgb(pat, 0.0, 0, 0, 0);
-  cairo_pattern_add_color_stop_rgb(pat, 0.1, 0.27, 0.27, 0.27);
-  cairo_pattern_add_color_stop_rgb(pat, 1.0, 0, 0, 0);
-  cairo_set_source(c, pat);
-  cairo_fill(c);
-
-  pat = cairo_pattern_create_linear(x + 1, y, x + 1, y + h - w);
-  cairo_pattern_add_color_stop_rgb(pat, 0.0, 0, 0, 0);
-  cairo_pattern_add_color_stop_rgb(pat, 0.1, 0.55, 0.55, 0.55);
-  cairo_pattern_add_color_stop_rgb(pat, 0.5, 0.45, 0.45, 0.45);
-  cairo_pattern_add_color_stop_rgb(pat, 0.5001, 0.35, 0.35, 0.35);
-  cairo_pattern_add_color_stop_rgb(pat, 1.0, 0.25, 0.25, 0.25);
-  cairo_set_source(c, pat);
-  cairo_rectangle(c, x + 1, y, w - 2, y + h - w);
-  cairo_fill(c);
-
-  if (pressed) piano_keyboard_draw_pressed(c, x, y, w, h, vel);
-
-  piano_keyboard_draw_key_shadow(c, x, y, w, h);
-
-  cairo_destroy(c);
-}
-
-void piano_keyboard_draw_pressed(cairo_t *c, int x, int y, int w, int h,
-                                 int vel) {
-  float m = w * .15;     // margin
-  float s = w - m * 2.;  // size
-  float _vel = ((float)vel / 127.);
-  float hue = _vel * 140 + 220;  // hue 220 .. 360 - blue over pink to red
-  float sat = .5 + _vel * 0.3;   // saturation 0.5 .. 0.8
-  float val = 1. - _vel * 0.2;   // lightness 1.0 .. 0.8
-  cairo_rectangle(c, x + m, y + h - m - s * 2, s, s * 2);
-  hsv HSV = {hue, sat, val};
-  rgb RGB = hsv2rgb(HSV);
-  cairo_set_source_rgb(c, RGB.r, RGB.g, RGB.b);
-  cairo_fill(c);
-}
-
-void piano_keyboard_draw_key_shadow(cairo_t *c, int x, int y, int w, int h) {
-  cairo_pattern_t *pat;
-  pat = cairo_pattern_create_linear(x, y, x, y + (int)(h * 0.2));
-  cairo_pattern_add_color_stop_rgba(pat, 0.0, 0, 0, 0, 0.4);
-  cairo_pattern_add_color_stop_rgba(pat, 1.0, 0, 0, 0, 0);
-  cairo_rectangle(c, x, y, w, (int)(h * 0.2));
-  cairo_set_source(c, pat);
-  cairo_fill(c);
-}
-
-rgb hsv2rgb(hsv HSV) {
-  rgb RGB;
-  double H = HSV.h, S = HSV.s, V = HSV.v, P, Q, T, fract;
-
-  (H == 360.) ? (H = 0.) : (H /= 60.);
-  fract = H - floor(H);
-
-  P = V * (1. - S);
-  Q = V * (1. - S * fract);
-  T = V * (1. - S * (1. - fract));
-
-  if (0. <= H && H < 1.)
-    RGB = (rgb){.r = V, .g = T, .b = P};
-  else if (1. <= H && H < 2.)
-    RGB = (rgb){.r = Q, .g = V, .b = P};
-  else if (2. <= H && H < 3.)
-    RGB = (rgb){.r = P, .g = V, .b = T};
-  else if (3. <= H && H < 4.)
-    RGB = (rgb){.r = P, .g = Q, .b = V};
-  else if (4. <= H && H < 5.)
-    RGB = (rgb){.r = T, .g = P, .b = V};
-  else if (5. <= H && H < 6.)
-    RGB = (rgb){.r = V, .g = P, .b = Q};
-  else
-    RGB = (rgb){.r = 0., .g = 0., .b = 0.};
-
-  return RGB;
+  queue_redraw(pk);
 }
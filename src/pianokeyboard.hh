@@ -30,6 +30,10 @@
 #include <glib.h>
 #include <gtk/gtkdrawingarea.h>
 
+#include "keyboardrenderer.hh"
+#include "keylayout.hh"
+#include "notestate.hh"
+
 G_BEGIN_DECLS
 
 #define TYPE_PIANO_KEYBOARD (piano_keyboard_get_type())
@@ -54,23 +58,21 @@ typedef struct _PianoKeyboardClass PianoKeyboardClass;
  60  = C4      (middle C)
  108 = C7      (piano maximum)
  127 = G9      (midi maximum)
+
+ NNOTES is defined in notestate.hh.
 */
-#define NNOTES 128
 #define PIANO_MIN_NOTE 21
 #define PIANO_MAX_NOTE 108
 
 #define OCTAVE_MIN -1
 #define OCTAVE_MAX 7
 
-struct Note {
-  int pressed;   /* 1 if key is in pressed down state. */
-  int sustained; /* 1 if note is sustained. */
-  int x;         /* Distance between the left edge of the key
-                  * and the left edge of the widget, in pixels. */
-  int w;         /* Width of the key, in pixels. */
-  int h;         /* Height of the key, in pixels. */
-  int white;     /* 1 if key is white; 0 otherwise. */
-  int velocity;
+/* Things that can hold a note down at the same time. */
+enum NoteSource {
+  NOTE_SOURCE_KEYBOARD,
+  NOTE_SOURCE_MOUSE,
+  NOTE_SOURCE_MIDI,
+  NOTE_SOURCES
 };
 
 struct _PianoKeyboard {
@@ -84,46 +86,45 @@ struct _PianoKeyboard {
   int min_note;
   int max_note;
   int current_velocity;
-  volatile struct Note notes[NNOTES];
-  /* Table used to translate from PC keyboard character to MIDI note number. */
-  GArray *key_bindings;
+  /* Note state, one bit per note; only touched from the GTK thread. */
+  NoteSet pressed;   /* Keys in pressed down state. */
+  NoteSet sustained; /* Notes that are sustained. */
+  unsigned char velocity[NNOTES];
+  /* Number of sources holding each note down.  Note on is sent when this goes
+   * from 0 to 1, note off when it goes back to 0. */
+  unsigned char holders[NNOTES];
+  /* Notes held by each source.  The mouse and MIDI hold a note at most once;
+   * the PC keyboard is tracked per key below, as several keys may be bound to
+   * the same note. */
+  NoteSet held_by[NOTE_SOURCES];
+  /* PC keyboard keys that are down, and the note each of them pressed. */
+  BitSet<NKEYCODES> keys_down;
+  unsigned char key_note[NKEYCODES];
+  /* Key geometry, only needed when drawing or hit testing. */
+  struct NoteGeometry geometry[NNOTES];
+  /* Paints the keyboard off the GTK thread. */
+  KeyboardRenderer *renderer;
+  /* Table used to translate from PC keyboard key code to MIDI note number,
+   * owned by keylayout.cc. */
+  const KeyBindingTable *key_bindings;
 };
 
 struct _PianoKeyboardClass {
   GtkDrawingAreaClass parent_class;
 };
 
-typedef struct {
-  double r;
-  double g;
-  double b;
-} rgb;
-
-typedef struct {
-  double h;
-  double s;
-  double v;
-} hsv;
-
 GType piano_keyboard_get_type(void) G_GNUC_CONST;
 GtkWidget *piano_keyboard_new(void);
 void piano_keyboard_sustain_press(PianoKeyboard *pk);
 void piano_keyboard_sustain_release(PianoKeyboard *pk);
-void piano_keyboard_set_note_on(PianoKeyboard *pk, int note, int vel);
-void piano_keyboard_set_note_off(PianoKeyboard *pk, int note);
+gboolean piano_keyboard_set_note_on(PianoKeyboard *pk, int note, int vel);
+gboolean piano_keyboard_set_note_off(PianoKeyboard *pk, int note);
+void piano_keyboard_set_all_notes_off(PianoKeyboard *pk);
 void piano_keyboard_set_keyboard_cue(PianoKeyboard *pk, int enabled);
 void piano_keyboard_set_octave(PianoKeyboard *pk, int octave);
 gboolean piano_keyboard_set_keyboard_layout(PianoKeyboard *pk,
                                             const char *layout);
 void piano_keyboard_enable_all_midi_notes(PianoKeyboard *pk);
-void piano_keyboard_draw_white_key(GtkWidget *widget, int x, int y, int w,
-                                   int h, int pressed, int val);
-void piano_keyboard_draw_black_key(GtkWidget *widget, int x, int y, int w,
-                                   int h, int pressed, int val);
-void piano_keyboard_draw_pressed(cairo_t *c, int x, int y, int w, int h,
-                                 int val);
-void piano_keyboard_draw_key_shadow(cairo_t *c, int x, int y, int w, int h);
-rgb hsv2rgb(hsv HSV);
 
 G_END_DECLS
 
@@ -1,12 +1,87 @@
 #pragma once
 
+#include <charconv>
 #include <filesystem>
 #include <fstream>
+#include <limits>
 #include <optional>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
-extern int MIDI_ERROR;
+constexpr int MIDI_ERROR = 0;
+
+constexpr char note_values[] = {
+    9,   // A
+    11,  // B
+    0,   // C
+    2,   // D
+    4,   // E
+    5,   // F
+    7    // G
+};
+
+/**
+ * Like string_to_midi, but returns std::nullopt for invalid notes so C-2
+ * can be told apart from an error
+ */
+constexpr std::optional<int> parse_note(std::string_view note) {
+  int midi = 24;  // C0 is 24
+  size_t note_index = 0;
+  // unlike std::string a view has no terminating '\0' to run into
+  auto at = [&note](size_t i) { return i < note.length() ? note[i] : '\0'; };
+  if (note.length() < 2) {
+    return std::nullopt;
+  }
+
+  // handle the base note
+  // A-G -> 0-6; a-g -> 0-6
+  // A < a
+  int c = static_cast<int>(at(note_index++));
+  c = c < 'a' ? (c - 'A') : (c - 'a');
+  if (c < 0 || c > 6) {
+    return std::nullopt;
+  }
+
+  // Sharp and flat
+  if (at(note_index) == '#') {
+    ++note_index;
+    midi += 1;
+  } else if (at(note_index) == 'b') {
+    ++note_index;
+    midi -= 1;
+  }
+
+  // negative octaves
+  int multiplier = 1;
+  if (at(note_index) == '-') {
+    if (note.length() < note_index + 1) {
+      return std::nullopt;
+    }
+    ++note_index;
+    multiplier = -1;
+  }
+
+  // both positive and negative octaves
+  // should be 0-8
+  int octave = static_cast<int>(at(note_index) - '0');
+  if (octave < 0 || octave > 8 || (multiplier == -1 && octave > 2)) {
+    return std::nullopt;
+  }
+
+  midi += note_values[c] + octave * 12 * multiplier;
+
+  // bounds check for things like A8
+  if (midi > 127) {
+    return {127};
+  }
+  // bounds check Cb-2
+  if (midi < 0) {
+    return {0};
+  }
+
+  return {midi};
+}
 
 /**
  * takes in things like "C#-2"
@@ -15,11 +90,38 @@ extern int MIDI_ERROR;
  * returns between 0 (C-2) - 127 (G8)
  *
  */
-int string_to_midi(const std::string &note);
+constexpr int string_to_midi(std::string_view note) {
+  return parse_note(note).value_or(MIDI_ERROR);
+}
 
 /**
  * Parses ints, if fail, return std::nullopt
  */
-std::optional<int> parse_int(const std::string &s);
+constexpr std::optional<int> parse_int(std::string_view s) {
+  if (std::is_constant_evaluated()) {
+    // std::from_chars is not constexpr before C++23
+    bool negative = !s.empty() && s[0] == '-';
+    std::string_view digits = s.substr(negative ? 1 : 0);
+    long long value = 0;
+
+    if (digits.empty()) return std::nullopt;
+    for (char c : digits) {
+      if (c < '0' || c > '9') return std::nullopt;
+      value = value * 10 + (c - '0');
+      if (value > std::numeric_limits<int>::max() + 1LL) return std::nullopt;
+    }
+    if (negative) value = -value;
+    if (value > std::numeric_limits<int>::max()) return std::nullopt;
+    return {static_cast<int>(value)};
+  }
+
+  int i;
+  const char *end = s.data() + s.length();
+  auto [ptr, ec] = std::from_chars(s.data(), end, i);
+  if (ec != std::errc{} || ptr != end) {
+    return std::nullopt;
+  }
+  return {i};
+}
 
 std::optional<std::string> read_file(const std::filesystem::path &path);